@@ -0,0 +1,425 @@
+/* posix_openpt() and the POSIX clocks are hidden when compiling with -std=c89 */
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/poll.h>
+
+#define MTXORB_FAST
+
+#include "mtxorb.h"
+#include "emu.h"
+
+#define LINK_CHUNK 16 /* bytes the emulator takes off the line at a time */
+
+
+MTXORB_DEFINE_FAST(bench, MTXORB_LKD, 20, 4)
+
+static const struct mtxorb_device_info bench_info = {
+    20,         /* Columns */
+    4,          /* Rows */
+    5,          /* Cellwidth */
+    8,          /* Cellheight */
+    MTXORB_LKD  /* Device type */
+};
+
+/* Emulated display on the master side of a pty, taking bytes off the line
+ * no faster than the baud rate would carry them */
+struct link {
+    int fd;
+    int baudrate;
+    struct emu emu;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long seen;     /* bytes processed by the display */
+    double cpu;             /* CPU time of the emulator thread, s */
+    int stop;
+};
+
+enum bench_mode {
+    MODE_DIRECT,
+    MODE_BUFFERED,
+    MODE_ASYNC
+};
+
+struct workload {
+    const char *name;
+    void (*frame)(MTXORB *h, int n);
+    int (*check)(const struct emu *e, int n);   /* 1 if the display shows frame n */
+};
+
+static double now_s(clockid_t clock);
+static void *link_run(void *arg);
+static int link_open(struct link *l, int baudrate);
+static void link_close(struct link *l);
+static double link_wait(struct link *l, unsigned long bytes);
+static int run(const struct workload *wl, enum bench_mode mode, int baudrate, int frames);
+
+static void frame_full(MTXORB *h, int n);
+static int check_full(const struct emu *e, int n);
+static void frame_sparse(MTXORB *h, int n);
+static int check_sparse(const struct emu *e, int n);
+static void frame_bars(MTXORB *h, int n);
+static int check_bars(const struct emu *e, int n);
+static void frame_gpo(MTXORB *h, int n);
+static int check_gpo(const struct emu *e, int n);
+static void frame_gpo_fast(MTXORB *h, int n);
+
+static const struct workload workloads[] = {
+    { "full", frame_full, check_full },         /* repaint of every cell */
+    { "sparse", frame_sparse, check_sparse },   /* a ticking clock */
+    { "bars", frame_bars, check_bars },         /* four animated bar graphs */
+    { "gpo", frame_gpo, check_gpo },            /* one output toggled per frame */
+    { "gpo-fast", frame_gpo_fast, check_gpo }   /* the same through the inline fast path */
+};
+
+static const char *mode_names[] = { "direct", "buffered", "async" };
+
+
+int main(int argc, char *argv[])
+{
+    int baudrate = 19200;
+    int frames = 50;
+    int opt, w, m;
+    int failed = 0;
+
+    while ((opt = getopt(argc, argv, "b:n:")) != -1) {
+        switch (opt) {
+        case 'b':
+            baudrate = atoi(optarg);
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b baudrate] [-n frames]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((baudrate <= 0) || (frames <= 0)) {
+        fprintf(stderr, "baudrate and frames must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%dx%d display, %d baud, %d frames per run\n\n",
+           bench_info.width, bench_info.height, baudrate, frames);
+    printf("%-8s %-8s %11s %12s %11s %11s %12s  %s\n", "workload", "mode",
+           "bytes/frame", "writes/frame", "lat avg ms", "lat max ms", "cpu us/frame", "screen");
+
+    for (w = 0; w < (int)(sizeof(workloads) / sizeof(workloads[0])); w++) {
+        for (m = MODE_DIRECT; m <= MODE_ASYNC; m++) {
+            if (run(&workloads[w], m, baudrate, frames) != 0)
+                failed = 1;
+        }
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Run one workload in one output mode on a fresh display and print a row.
+ * Returns 0 if the display ended up showing the last frame. */
+static int run(const struct workload *wl, enum bench_mode mode, int baudrate, int frames)
+{
+    struct link l;
+    struct mtxorb_stats st;
+    MTXORB *h;
+    unsigned long bytes, writes;
+    double t0, c0, e0, e1, lat, cpu;
+    double lat_sum = 0, lat_max = 0, cpu_sum = 0;
+    int n, ok;
+
+    if (link_open(&l, baudrate) != 0) {
+        perror("pty");
+        return -1;
+    }
+
+    h = mtxorb_open(ptsname(l.fd), baudrate, &bench_info);
+    if (h == NULL) {
+        perror("mtxorb_open");
+        link_close(&l);
+        return -1;
+    }
+
+    if (mode == MODE_BUFFERED)
+        mtxorb_set_buffered(h, MTXORB_ON, 0);
+    else if (mode == MODE_ASYNC)
+        mtxorb_set_async(h, MTXORB_ON);
+
+    /* Let the display process the commands sent by mtxorb_open() */
+    mtxorb_get_stats(h, &st);
+    link_wait(&l, st.bytes_written);
+    bytes = st.bytes_written;
+    writes = st.write_calls;
+
+    for (n = 0; n < frames; n++) {
+        t0 = now_s(CLOCK_MONOTONIC);
+        c0 = now_s(CLOCK_PROCESS_CPUTIME_ID);
+        e0 = link_wait(&l, 0);
+
+        wl->frame(h, n);
+        mtxorb_flush(h);
+        mtxorb_sync(h, -1);
+
+        /* A frame is done when the display has seen its last byte */
+        mtxorb_get_stats(h, &st);
+        e1 = link_wait(&l, st.bytes_written);
+        lat = now_s(CLOCK_MONOTONIC) - t0;
+
+        /* CPU of the application and the library, without the emulator */
+        cpu = now_s(CLOCK_PROCESS_CPUTIME_ID) - c0 - (e1 - e0);
+
+        lat_sum += lat;
+        cpu_sum += cpu;
+        if (lat > lat_max)
+            lat_max = lat;
+    }
+
+    ok = wl->check(&l.emu, frames - 1) && (l.emu.unknown == 0);
+
+    printf("%-8s %-8s %11.1f %12.2f %11.2f %11.2f %12.1f  %s\n", wl->name, mode_names[mode],
+           (double)(st.bytes_written - bytes) / frames,
+           (double)(st.write_calls - writes) / frames,
+           lat_sum * 1000 / frames, lat_max * 1000,
+           cpu_sum * 1000000 / frames, ok ? "ok" : "MISMATCH");
+
+    mtxorb_close(h);
+    link_close(&l);
+
+    return ok ? 0 : -1;
+}
+
+/* ----- Workloads ----- */
+
+static void frame_full(MTXORB *h, int n)
+{
+    char row[EMU_MAX_WIDTH + 1];
+    int x, y;
+
+    mtxorb_fb_invalidate(h);
+
+    for (y = 0; y < bench_info.height; y++) {
+        for (x = 0; x < bench_info.width; x++)
+            row[x] = 'A' + (n + x + y) % 26;
+        row[x] = '\0';
+        mtxorb_fb_put(h, 0, y, row);
+    }
+
+    mtxorb_fb_present(h);
+}
+
+static int check_full(const struct emu *e, int n)
+{
+    int x, y;
+
+    for (y = 0; y < bench_info.height; y++) {
+        for (x = 0; x < bench_info.width; x++) {
+            if (e->screen[y][x] != 'A' + (n + x + y) % 26)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void clock_text(char *s, int n)
+{
+    sprintf(s, "%02d:%02d:%02d", (n / 3600) % 24, (n / 60) % 60, n % 60);
+}
+
+static void frame_sparse(MTXORB *h, int n)
+{
+    char s[16];
+
+    clock_text(s, n);
+    mtxorb_fb_put(h, 0, 0, "Uptime");
+    mtxorb_fb_put(h, 6, 1, s);
+    mtxorb_fb_present(h);
+}
+
+static int check_sparse(const struct emu *e, int n)
+{
+    char s[16];
+
+    clock_text(s, n);
+
+    return (memcmp(e->screen[0], "Uptime", 6) == 0) &&
+           (memcmp(&e->screen[1][6], s, strlen(s)) == 0);
+}
+
+static int bar_len(int n, int y)
+{
+    return (n * 7 + y * 25) % (bench_info.width * bench_info.cellwidth + 1);
+}
+
+static void frame_bars(MTXORB *h, int n)
+{
+    int y;
+
+    for (y = 0; y < bench_info.height; y++)
+        mtxorb_fb_hbar(h, 0, y, bench_info.width, bar_len(n, y), MTXORB_RIGHT);
+
+    mtxorb_fb_present(h);
+}
+
+static int check_bars(const struct emu *e, int n)
+{
+    int x, y, len, px;
+
+    for (y = 0; y < bench_info.height; y++) {
+        len = 0;
+        for (x = 0; x < bench_info.width; x++) {
+            if ((px = emu_pixels(e, x, y)) < 0)
+                return 0;
+            len += px;
+        }
+        if (len != bar_len(n, y))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Gray code, so exactly one output changes from frame to frame */
+static int gpo_state(int n)
+{
+    return (n ^ (n >> 1)) & 0x3F;
+}
+
+static void frame_gpo(MTXORB *h, int n)
+{
+    mtxorb_set_output(h, (enum mtxorb_gpo_flags)gpo_state(n));
+}
+
+/* The fast path has no cache, so only the output that changes is set */
+static void frame_gpo_fast(MTXORB *h, int n)
+{
+    int changed = gpo_state(n) ^ gpo_state(n - 1);
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        if (changed & (1 << i))
+            bench_output(h, i, (gpo_state(n) & (1 << i)) ? MTXORB_ON : MTXORB_OFF);
+    }
+}
+
+static int check_gpo(const struct emu *e, int n)
+{
+    return e->gpo == gpo_state(n);
+}
+
+/* ----- Emulated display ----- */
+
+static int link_open(struct link *l, int baudrate)
+{
+    memset(l, 0, sizeof(struct link));
+
+    if ((l->fd = posix_openpt(O_RDWR | O_NOCTTY)) == -1)
+        return -1;
+
+    if ((grantpt(l->fd) == -1) || (unlockpt(l->fd) == -1)) {
+        close(l->fd);
+        return -1;
+    }
+
+    l->baudrate = baudrate;
+    emu_init(&l->emu, &bench_info);
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cond, NULL);
+
+    if (pthread_create(&l->thread, NULL, link_run, l) != 0) {
+        close(l->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void link_close(struct link *l)
+{
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_mutex_unlock(&l->lock);
+
+    pthread_join(l->thread, NULL);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->cond);
+    close(l->fd);
+}
+
+/* Wait until the display has processed 'bytes' bytes.
+ * Returns the CPU time used by the emulator so far. */
+static double link_wait(struct link *l, unsigned long bytes)
+{
+    double cpu;
+
+    pthread_mutex_lock(&l->lock);
+    while (l->seen < bytes)
+        pthread_cond_wait(&l->cond, &l->lock);
+    cpu = l->cpu;
+    pthread_mutex_unlock(&l->lock);
+
+    return cpu;
+}
+
+static void *link_run(void *arg)
+{
+    struct link *l = arg;
+    struct pollfd fds[1];
+    struct timespec due, now;
+    unsigned char buf[LINK_CHUNK];
+    long wire;
+    ssize_t n;
+    int stop = 0;
+
+    fds[0].fd = l->fd;
+    fds[0].events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &due);
+
+    while (!stop) {
+        if (poll(fds, 1, 20) > 0) {
+            if ((n = read(l->fd, buf, sizeof(buf))) <= 0)
+                break;
+
+            /* An idle line doesn't get ahead of the clock */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec > due.tv_sec) ||
+                ((now.tv_sec == due.tv_sec) && (now.tv_nsec > due.tv_nsec)))
+                due = now;
+
+            /* 8-N-1 takes 10 bits per byte on the wire */
+            wire = (long)(n * 10 * (1000000000.0 / l->baudrate));
+            due.tv_nsec += wire % 1000000000;
+            due.tv_sec += wire / 1000000000 + due.tv_nsec / 1000000000;
+            due.tv_nsec %= 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+
+            emu_feed(&l->emu, buf, n);
+        } else
+            n = 0;
+
+        pthread_mutex_lock(&l->lock);
+        l->seen += n;
+        l->cpu = now_s(CLOCK_THREAD_CPUTIME_ID);
+        stop = l->stop;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+    }
+
+    return NULL;
+}
+
+static double now_s(clockid_t clock)
+{
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
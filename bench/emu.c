@@ -0,0 +1,201 @@
+#include <string.h>
+
+#include "emu.h"
+
+static void emu_command(struct emu *e);
+static void emu_text(struct emu *e, unsigned char c);
+
+
+void emu_init(struct emu *e, const struct mtxorb_device_info *info)
+{
+    memset(e, 0, sizeof(struct emu));
+    e->info = *info;
+    memset(e->screen, ' ', sizeof(e->screen));
+    e->wrap = 1;
+    e->scroll = 1;
+}
+
+void emu_feed(struct emu *e, const unsigned char *buf, size_t n)
+{
+    size_t i;
+    int args;
+
+    for (i = 0; i < n; i++) {
+        e->bytes++;
+
+        if (e->have == 0) {
+            if (buf[i] == 0xFE)
+                e->cmd[e->have++] = buf[i];
+            else
+                emu_text(e, buf[i]);
+            continue;
+        }
+
+        e->cmd[e->have++] = buf[i];
+
+        /* The opcode tells how many arguments follow */
+        if (e->have == 2) {
+            args = emu_args(e, buf[i]);
+            if (args < 0) {
+                e->unknown++;
+                args = 0;
+            }
+            e->need = 2 + args;
+        }
+
+        if (e->have == e->need) {
+            emu_command(e);
+            e->commands++;
+            e->have = 0;
+        }
+    }
+}
+
+int emu_args(const struct emu *e, unsigned char op)
+{
+    switch (op) {
+    case 'N':
+        return 9;
+    case '|':
+        return 4;
+    case 'o':
+    case 0x82:
+        return 3;
+    case 'G':
+    case '=':
+    case '#':
+        return 2;
+    case 'B':
+    case 'P':
+    case 'Y':
+    case 'U':
+    case '9':
+    case 0x7E:
+    case 0x99:
+    case 0x9C:
+        return 1;
+    case 'V':
+    case 'W':
+        return ((e->info.type == MTXORB_LKD) || (e->info.type == MTXORB_VKD)) ? 1 : 0;
+    case 'X':
+    case 'H':
+    case 'S':
+    case 'T':
+    case 'J':
+    case 'K':
+    case 'Q':
+    case 'R':
+    case 'C':
+    case 'D':
+    case 'h':
+    case 'v':
+    case 's':
+    case 'm':
+    case 'n':
+    case 'F':
+    case 'A':
+    case 'O':
+    case '6':
+    case '7':
+    case 0x9B:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int emu_pixels(const struct emu *e, int x, int y)
+{
+    unsigned char c = e->screen[y][x];
+    int bits, n = 0;
+
+    if (c >= 8)
+        return (c == ' ') ? 0 : -1;
+
+    for (bits = e->cgram[c][0]; bits != 0; bits >>= 1)
+        n += bits & 1;
+
+    return n;
+}
+
+static void emu_command(struct emu *e)
+{
+    unsigned char *a = e->cmd + 2;
+    int gpo;
+
+    switch (e->cmd[1]) {
+    case 'X':
+        memset(e->screen, ' ', sizeof(e->screen));
+        e->x = 0;
+        e->y = 0;
+        break;
+    case 'H':
+        e->x = 0;
+        e->y = 0;
+        break;
+    case 'G':
+        if ((a[0] >= 1) && (a[0] <= e->info.width) &&
+            (a[1] >= 1) && (a[1] <= e->info.height)) {
+            e->x = a[0] - 1;
+            e->y = a[1] - 1;
+        }
+        break;
+    case 'C':
+    case 'D':
+        e->wrap = (e->cmd[1] == 'C');
+        break;
+    case 'Q':
+    case 'R':
+        e->scroll = (e->cmd[1] == 'Q');
+        break;
+    case 'N':
+        memcpy(e->cgram[a[0] & 7], a + 1, 8);
+        break;
+    case 'h':
+    case 'v':
+    case 's':
+    case 'm':
+    case 'n':
+        /* Built-in bar and number sets replace the custom characters */
+        memset(e->cgram, 0, sizeof(e->cgram));
+        break;
+    case 'W':
+    case 'V':
+        gpo = (e->need > 2) ? a[0] - 1 : 0;
+        if ((gpo >= 0) && (gpo < 6)) {
+            if (e->cmd[1] == 'W')
+                e->gpo |= 1 << gpo;
+            else
+                e->gpo &= ~(1 << gpo);
+        }
+        break;
+    default:
+        /* Settings and placed bars don't change the screen model */
+        break;
+    }
+}
+
+static void emu_text(struct emu *e, unsigned char c)
+{
+    e->text++;
+
+    /* The cursor wraps when the next character arrives, so filling the
+     * last cell doesn't scroll yet */
+    if (e->x >= e->info.width) {
+        /* Without line wrap characters past the end of the row are lost */
+        if (!e->wrap)
+            return;
+
+        e->x = 0;
+        if (++e->y == e->info.height) {
+            if (e->scroll) {
+                memmove(e->screen[0], e->screen[1], (EMU_MAX_HEIGHT - 1) * EMU_MAX_WIDTH);
+                memset(e->screen[e->info.height - 1], ' ', EMU_MAX_WIDTH);
+                e->y = e->info.height - 1;
+            } else
+                e->y = 0;
+        }
+    }
+
+    e->screen[e->y][e->x++] = c;
+}
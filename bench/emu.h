@@ -0,0 +1,47 @@
+#ifndef _EMU_H
+#define _EMU_H
+
+#include <sys/types.h>
+
+#include "mtxorb.h"
+
+#define EMU_MAX_WIDTH 40
+#define EMU_MAX_HEIGHT 4
+
+/*
+ * Model of a Matrix Orbital display, fed with the byte stream the library
+ * sends. Knows the commands the library uses, anything else counts as an
+ * unknown command without arguments.
+ */
+struct emu {
+    struct mtxorb_device_info info;
+
+    unsigned char screen[EMU_MAX_HEIGHT][EMU_MAX_WIDTH];
+    unsigned char cgram[8][8];  /* custom characters */
+    int x, y;                   /* cursor position */
+    int wrap;                   /* auto line wrap */
+    int scroll;                 /* auto scroll */
+    int gpo;                    /* bitmap of output states */
+
+    unsigned long bytes;        /* bytes fed */
+    unsigned long text;         /* characters put on the screen */
+    unsigned long commands;     /* complete commands */
+    unsigned long unknown;      /* commands with an unknown opcode */
+
+    /* Command parser */
+    unsigned char cmd[16];
+    int have;                   /* bytes of the current command, 0 = none */
+    int need;                   /* bytes the current command takes */
+};
+
+extern void emu_init(struct emu *e, const struct mtxorb_device_info *info);
+
+extern void emu_feed(struct emu *e, const unsigned char *buf, size_t n);
+
+/* Number of arguments of a command, -1 if the opcode is unknown */
+extern int emu_args(const struct emu *e, unsigned char op);
+
+/* Number of filled pixels in the top row of the character at (x, y) */
+extern int emu_pixels(const struct emu *e, int x, int y);
+
+#endif /* _EMU_H */
@@ -0,0 +1,775 @@
+/* posix_openpt() is hidden when compiling with -std=c89 */
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef MTXORB_LIBFUZZER
+#include <stdint.h>
+#endif
+
+#include "mtxorb.h"
+#include "emu.h"
+
+/*
+ * Fuzzer for the command encoders. Every input is decoded into a display
+ * type and a sequence of API calls, with text, coordinates and ids taken
+ * from the input. After each call the bytes sent are parsed the way the
+ * display parses them, with the command lengths of the manuals rather than
+ * the library's own table: a call may only send complete commands of its
+ * own that the display type has, so text that makes it through as 0xFE
+ * shows up as a foreign or unfinished command.
+ *
+ * main() first runs fixed checks of the custom character bank against an
+ * emulated display, then the files named on the command line, or random
+ * inputs. Built with -DMTXORB_LIBFUZZER, this is a libFuzzer target
+ * instead, running the checks once at startup.
+ */
+
+#define TEXT_MAX 32
+#define SINK_MAX 65536
+
+/* Display types, as bits */
+#define T_LCD 0x01
+#define T_LKD 0x02
+#define T_VFD 0x04
+#define T_VKD 0x08
+#define T_ALL (T_LCD | T_LKD | T_VFD | T_VKD)
+#define T_KEYPAD (T_LKD | T_VKD)
+
+/* A command of the Matrix Orbital manuals: the number of bytes after the
+ * opcode, on displays without and with a keypad, and the types having it */
+struct spec {
+    unsigned char op;
+    int args;
+    int keypad_args;
+    int types;
+};
+
+static const struct spec specs[] = {
+    { 'X', 0, 0, T_ALL },                   /* clear screen */
+    { 'H', 0, 0, T_ALL },                   /* go home */
+    { 'G', 2, 2, T_ALL },                   /* column, row */
+    { 'J', 0, 0, T_ALL },                   /* underline cursor on */
+    { 'K', 0, 0, T_ALL },                   /* underline cursor off */
+    { 'S', 0, 0, T_ALL },                   /* block cursor on */
+    { 'T', 0, 0, T_ALL },                   /* block cursor off */
+    { 'Q', 0, 0, T_ALL },                   /* auto scroll on */
+    { 'R', 0, 0, T_ALL },                   /* auto scroll off */
+    { 'C', 0, 0, T_ALL },                   /* auto line wrap on */
+    { 'D', 0, 0, T_ALL },                   /* auto line wrap off */
+    { 'N', 9, 9, T_ALL },                   /* custom character: id, 8 rows */
+    { 'h', 0, 0, T_ALL },                   /* init horizontal bars */
+    { '|', 4, 4, T_ALL },                   /* column, row, direction, length */
+    { 'v', 0, 0, T_ALL },                   /* init wide vertical bars */
+    { 's', 0, 0, T_ALL },                   /* init narrow vertical bars */
+    { '=', 2, 2, T_ALL },                   /* column, length */
+    { 'm', 0, 0, T_ALL },                   /* init medium numbers */
+    { 'o', 3, 3, T_ALL },                   /* row, column, digit */
+    { 'n', 0, 0, T_ALL },                   /* init large numbers */
+    { '#', 2, 2, T_ALL },                   /* column, digit */
+    { 'F', 0, 0, T_ALL },                   /* backlight off */
+    { 'B', 1, 1, T_ALL },                   /* backlight on: minutes */
+    { 'P', 1, 1, T_LCD | T_LKD },           /* contrast */
+    { 0x99, 1, 1, T_LCD | T_LKD },          /* backlight brightness */
+    { 'Y', 1, 1, T_VFD | T_VKD },           /* VFD brightness */
+    { 0x82, 3, 3, T_LKD },                  /* backlight color: red, green, blue */
+    { 'W', 0, 1, T_ALL },                   /* output on: number on keypad modules */
+    { 'V', 0, 1, T_ALL },                   /* output off */
+    { 'A', 0, 0, T_KEYPAD },                /* auto transmit keys on */
+    { 'O', 0, 0, T_KEYPAD },                /* auto transmit keys off */
+    { 0x7E, 1, 1, T_KEYPAD },               /* key auto repeat mode */
+    { 'U', 1, 1, T_KEYPAD },                /* key debounce time */
+    { 0x9C, 1, 1, T_LKD },                  /* keypad brightness */
+    { 0x9B, 0, 0, T_LKD },                  /* keypad backlight off */
+    { '9', 1, 1, T_ALL },                   /* baud rate */
+    { '6', 0, 0, T_ALL },                   /* read version */
+    { '7', 0, 0, T_ALL }                    /* read module type */
+};
+
+#define SPEC_COUNT ((int)(sizeof(specs) / sizeof(specs[0])))
+
+static const struct {
+    enum mtxorb_type type;
+    int bit;
+} types[] = {
+    { MTXORB_LCD, T_LCD },
+    { MTXORB_LKD, T_LKD },
+    { MTXORB_VFD, T_VFD },
+    { MTXORB_VKD, T_VKD }
+};
+
+/* Input being decoded */
+struct input {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+};
+
+/* Opcodes a call may send, the framebuffer may send any of its own */
+#define FB_OPS "GNXH"
+#define SETTING_OPS "PYUFSTJKQRCD" "\x99\x82\x7E\x9C\x9B"
+
+struct call {
+    const char *name;
+    const char *ops;
+    void (*run)(MTXORB *h, struct input *in);
+};
+
+static void fuzz_one(const unsigned char *data, size_t size);
+static MTXORB *fuzz_open(int *fd);
+static void fuzz_close(MTXORB *h, int fd);
+static void check_glyphs(void);
+static void check_bars(void);
+static void check_bignum(void);
+static int same_cell(const struct emu *a, const struct emu *b, int x, int y);
+static void present(MTXORB *h, int fd, struct emu *e);
+static const struct spec *find_spec(unsigned char op);
+static int next(struct input *in);
+static int next_int(struct input *in);
+static void next_text(struct input *in, char *s);
+static int sink_open(void);
+static void check(const struct call *c, const unsigned char *buf, size_t n);
+static void fail(const struct call *c, const unsigned char *buf, size_t n, const char *why);
+
+static void run_puts(MTXORB *h, struct input *in);
+static void run_putc(MTXORB *h, struct input *in);
+static void run_gotoxy(MTXORB *h, struct input *in);
+static void run_custom_char(MTXORB *h, struct input *in);
+static void run_hbar(MTXORB *h, struct input *in);
+static void run_vbar(MTXORB *h, struct input *in);
+static void run_bignum(MTXORB *h, struct input *in);
+static void run_clear(MTXORB *h, struct input *in);
+static void run_output(MTXORB *h, struct input *in);
+static void run_batch(MTXORB *h, struct input *in);
+static void run_fb_put(MTXORB *h, struct input *in);
+static void run_fb_bars(MTXORB *h, struct input *in);
+static void run_fb_bigstr(MTXORB *h, struct input *in);
+static void run_widget(MTXORB *h, struct input *in);
+static void run_fb_present(MTXORB *h, struct input *in);
+static void run_setting(MTXORB *h, struct input *in);
+
+static const struct call calls[] = {
+    { "puts", "", run_puts },
+    { "putc", "", run_putc },
+    { "gotoxy", "GH", run_gotoxy },
+    { "set_custom_char", "N", run_custom_char },
+    { "hbar", "h|", run_hbar },
+    { "vbar", "hv=", run_vbar },
+    { "bignum", "mno#", run_bignum },
+    { "clear", "X", run_clear },
+    { "set_output_mask", "VW", run_output },
+    { "batch", "G", run_batch },
+    { "fb_put", "", run_fb_put },
+    { "fb_bars", "N", run_fb_bars },
+    { "fb_bigstr", "N", run_fb_bigstr },
+    { "widget", "", run_widget },
+    { "fb_present", FB_OPS, run_fb_present },
+    { "setting", SETTING_OPS, run_setting }
+};
+
+#define CALL_COUNT ((int)(sizeof(calls) / sizeof(calls[0])))
+
+static struct mtxorb_device_info info = {
+    20,         /* Columns */
+    4,          /* Rows */
+    5,          /* Cellwidth */
+    8,          /* Cellheight */
+    MTXORB_LKD  /* Device type, from the input */
+};
+static int type_bit;
+static int sink = -1;
+static const struct input *current;
+
+
+static void fuzz_one(const unsigned char *data, size_t size)
+{
+    static unsigned char buf[SINK_MAX];
+    struct input in;
+    const struct call *c;
+    MTXORB *h;
+    int fd, t;
+    ssize_t n;
+
+    in.data = data;
+    in.size = size;
+    in.pos = 0;
+    current = &in;
+
+    /* Capabilities change what gets sent */
+    t = next(&in) % (int)(sizeof(types) / sizeof(types[0]));
+    info.type = types[t].type;
+    type_bit = types[t].bit;
+
+    h = fuzz_open(&fd);
+
+    while (in.pos < in.size) {
+        c = &calls[next(&in) % CALL_COUNT];
+        c->run(h, &in);
+
+        n = read(fd, buf, sizeof(buf));
+        if ((n == -1) && (errno != EAGAIN))
+            abort();
+        check(c, buf, (n > 0) ? (size_t)n : 0);
+    }
+
+    fuzz_close(h, fd);
+}
+
+/* Open a display of the current type. The port is swapped for a pipe to
+ * read back what is sent, *fd is its read end. The pty only serves to pass
+ * the port setup in mtxorb_open(). */
+static MTXORB *fuzz_open(int *fd)
+{
+    MTXORB *h;
+    int pfd[2];
+
+    if ((sink == -1) && (sink_open() != 0)) {
+        perror("sink");
+        abort();
+    }
+
+    if ((h = mtxorb_open(ptsname(sink), 115200, &info)) == NULL) {
+        perror("mtxorb_open");
+        abort();
+    }
+
+    if (pipe(pfd) == -1) {
+        perror("pipe");
+        abort();
+    }
+    fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+    dup2(pfd[1], mtxorb_get_fd(h));
+    close(pfd[1]);
+    *fd = pfd[0];
+
+    return h;
+}
+
+static void fuzz_close(MTXORB *h, int fd)
+{
+    unsigned char buf[256];
+
+    mtxorb_close(h);
+    close(fd);
+
+    /* Discard what mtxorb_open() sent to the pty */
+    while (read(sink, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/* Present the framebuffer and feed what was sent to the emulated display */
+static void present(MTXORB *h, int fd, struct emu *e)
+{
+    static unsigned char buf[SINK_MAX];
+    ssize_t n;
+
+    mtxorb_fb_present(h);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        emu_feed(e, buf, (size_t)n);
+}
+
+/* ----- Custom character bank ----- */
+
+/* More glyphs than the bank holds in one frame: every cell must show its
+ * own glyph, or be blank where none was free */
+static void check_glyphs(void)
+{
+    unsigned char glyph[12][8];
+    struct emu e;
+    MTXORB *h;
+    int fd, id, i, row, loaded = 0;
+    unsigned char c;
+
+    info.type = MTXORB_LKD;
+    type_bit = T_LKD;
+    h = fuzz_open(&fd);
+    emu_init(&e, &info);
+
+    for (i = 0; i < 12; i++) {
+        for (row = 0; row < 8; row++)
+            glyph[i][row] = (unsigned char)((i * 7 + row) & 0x1F);
+        id = mtxorb_load_glyph(h, (const char *)glyph[i]);
+        mtxorb_fb_putc(h, i, 0, (char)((id < 0) ? ' ' : id));
+        loaded += (id >= 0);
+    }
+    present(h, fd, &e);
+
+    for (i = 0; i < 12; i++) {
+        c = e.screen[0][i];
+        if ((c != ' ') && ((c >= 8) || (memcmp(e.cgram[c], glyph[i], 8) != 0))) {
+            fprintf(stderr, "glyphs: cell %d shows another glyph\n", i);
+            abort();
+        }
+    }
+    if (loaded != 8) {
+        fprintf(stderr, "glyphs: %d of 12 loaded, the bank holds 8\n", loaded);
+        abort();
+    }
+
+    fuzz_close(h, fd);
+}
+
+/* A bar, then icons taking the rest of the bank and two more bars: the
+ * first bar's cells must not change, the new partial cells fall back to
+ * the character ROM */
+static void check_bars(void)
+{
+    struct emu e, before;
+    MTXORB *h;
+    int fd, x;
+
+    info.type = MTXORB_LKD;
+    type_bit = T_LKD;
+    h = fuzz_open(&fd);
+    emu_init(&e, &info);
+
+    /* 6 full cells and one of 3 pixels, 2 glyphs */
+    mtxorb_fb_hbar(h, 0, 0, 20, 33, MTXORB_RIGHT);
+    present(h, fd, &e);
+    before = e;
+
+    for (x = 0; x < 8; x++)
+        mtxorb_fb_icon(h, x, 1, (enum mtxorb_icon)x);
+    mtxorb_fb_hbar(h, 0, 2, 19, 47, MTXORB_RIGHT);
+    mtxorb_fb_vbar(h, 19, 3, 1, 5);
+    present(h, fd, &e);
+
+    for (x = 0; x < info.width; x++) {
+        if (!same_cell(&before, &e, x, 0)) {
+            fprintf(stderr, "bars: cell %d of the first bar changed\n", x);
+            abort();
+        }
+    }
+    for (x = 0; x < 9; x++) {
+        if (e.screen[2][x] != e.screen[0][0]) {
+            fprintf(stderr, "bars: full cell %d of the second bar isn't the shared glyph\n", x);
+            abort();
+        }
+    }
+    if ((e.screen[2][9] != ' ') || (e.screen[3][19] != 0xFF)) {
+        fprintf(stderr, "bars: no fallback for partial cells, %02X %02X\n",
+                e.screen[2][9], e.screen[3][19]);
+        abort();
+    }
+
+    fuzz_close(h, fd);
+}
+
+/* Icons leave one custom character for a big 8, which needs two: the
+ * icons must not change and the miss is counted */
+static void check_bignum(void)
+{
+    struct mtxorb_stats st;
+    struct emu e, before;
+    MTXORB *h;
+    int fd, x;
+
+    info.type = MTXORB_LKD;
+    type_bit = T_LKD;
+    h = fuzz_open(&fd);
+    emu_init(&e, &info);
+
+    for (x = 0; x < 7; x++)
+        mtxorb_fb_icon(h, x, 0, (enum mtxorb_icon)x);
+    present(h, fd, &e);
+    before = e;
+
+    mtxorb_fb_bignum(h, 10, 2, 8);
+    present(h, fd, &e);
+    mtxorb_get_stats(h, &st);
+
+    for (x = 0; x < 7; x++) {
+        if (!same_cell(&before, &e, x, 0)) {
+            fprintf(stderr, "bignum: icon %d changed\n", x);
+            abort();
+        }
+    }
+    if ((e.screen[2][10] != 0xFF) || (st.glyphs_missed != 1)) {
+        fprintf(stderr, "bignum: %02X in a full cell, %lu glyphs missed\n",
+                e.screen[2][10], st.glyphs_missed);
+        abort();
+    }
+
+    fuzz_close(h, fd);
+}
+
+/* Whether cell (x, y) looks the same on two displays */
+static int same_cell(const struct emu *a, const struct emu *b, int x, int y)
+{
+    unsigned char ca = a->screen[y][x], cb = b->screen[y][x];
+
+    if ((ca >= 8) || (cb >= 8))
+        return ca == cb;
+
+    return memcmp(a->cgram[ca], b->cgram[cb], 8) == 0;
+}
+
+/* Parse the output of one call like the display does */
+static void check(const struct call *c, const unsigned char *buf, size_t n)
+{
+    const struct spec *sp;
+    size_t i;
+    int need = 0;   /* bytes of arguments left, -1 = opcode next */
+
+    for (i = 0; i < n; i++) {
+        if (need > 0) {
+            need--;
+        } else if (need == -1) {
+            if ((sp = find_spec(buf[i])) == NULL)
+                fail(c, buf, n, "unknown command");
+            if (!(sp->types & type_bit))
+                fail(c, buf, n, "command the display type doesn't have");
+            if (strchr(c->ops, buf[i]) == NULL)
+                fail(c, buf, n, "command not sent by this call");
+            need = (type_bit & T_KEYPAD) ? sp->keypad_args : sp->args;
+        } else if (buf[i] == 0xFE) {
+            need = -1;
+        }
+    }
+
+    if (need != 0)
+        fail(c, buf, n, "unfinished command");
+}
+
+static const struct spec *find_spec(unsigned char op)
+{
+    int i;
+
+    for (i = 0; i < SPEC_COUNT; i++) {
+        if (specs[i].op == op)
+            return &specs[i];
+    }
+
+    return NULL;
+}
+
+static void fail(const struct call *c, const unsigned char *buf, size_t n, const char *why)
+{
+    size_t i;
+
+    fprintf(stderr, "%s on type %d: %s in", c->name, (int)info.type, why);
+    for (i = 0; i < n; i++)
+        fprintf(stderr, " %02X", buf[i]);
+    fprintf(stderr, "\ninput:");
+    for (i = 0; i < current->size; i++)
+        fprintf(stderr, " %02X", current->data[i]);
+    fprintf(stderr, "\n");
+
+    abort();
+}
+
+static int sink_open(void)
+{
+    if ((sink = posix_openpt(O_RDWR | O_NOCTTY)) == -1)
+        return -1;
+
+    if ((grantpt(sink) == -1) || (unlockpt(sink) == -1)) {
+        close(sink);
+        sink = -1;
+        return -1;
+    }
+
+    fcntl(sink, F_SETFL, O_NONBLOCK);
+
+    return 0;
+}
+
+/* ----- Input decoding ----- */
+
+/* Inputs are padded with zeros */
+static int next(struct input *in)
+{
+    return (in->pos < in->size) ? in->data[in->pos++] : 0;
+}
+
+/* Mostly small values, with negative and out of range ones */
+static int next_int(struct input *in)
+{
+    return (signed char)next(in);
+}
+
+static void next_text(struct input *in, char *s)
+{
+    int len = next(in) % TEXT_MAX;
+
+    while ((len-- > 0) && (in->pos < in->size))
+        *s++ = (char)next(in);
+    *s = '\0';
+}
+
+/* ----- Calls ----- */
+
+static void run_puts(MTXORB *h, struct input *in)
+{
+    char s[TEXT_MAX + 1];
+
+    next_text(in, s);
+    mtxorb_puts(h, s);
+}
+
+static void run_putc(MTXORB *h, struct input *in)
+{
+    mtxorb_putc(h, (char)next(in));
+}
+
+static void run_gotoxy(MTXORB *h, struct input *in)
+{
+    int x = next_int(in);
+
+    mtxorb_gotoxy(h, x, next_int(in));
+}
+
+static void run_custom_char(MTXORB *h, struct input *in)
+{
+    char data[8];
+    int id = next_int(in), i;
+
+    for (i = 0; i < 8; i++)
+        data[i] = (char)next(in);
+
+    mtxorb_set_custom_char(h, id, data);
+}
+
+static void run_hbar(MTXORB *h, struct input *in)
+{
+    int x = next_int(in);
+    int y = next_int(in);
+    int len = next(in);
+
+    mtxorb_hbar(h, x, y, len, (next(in) & 1) ? MTXORB_LEFT : MTXORB_RIGHT);
+}
+
+static void run_vbar(MTXORB *h, struct input *in)
+{
+    int x = next_int(in);
+    int len = next(in);
+
+    mtxorb_vbar(h, x, len, (next(in) & 1) ? MTXORB_WIDE : MTXORB_NARROW);
+}
+
+static void run_bignum(MTXORB *h, struct input *in)
+{
+    int x = next_int(in);
+    int y = next_int(in);
+    int digit = next_int(in);
+
+    mtxorb_bignum(h, x, y, digit, (next(in) & 1) ? MTXORB_LARGE : MTXORB_MEDIUM);
+}
+
+static void run_clear(MTXORB *h, struct input *in)
+{
+    (void)in;
+    mtxorb_clear(h);
+}
+
+static void run_output(MTXORB *h, struct input *in)
+{
+    int mask = next(in);
+
+    mtxorb_set_output_mask(h, (enum mtxorb_gpo_flags)mask, (enum mtxorb_gpo_flags)next(in));
+}
+
+static void run_batch(MTXORB *h, struct input *in)
+{
+    struct mtxorb_batch b;
+    char s[TEXT_MAX + 1];
+    int x = next_int(in);
+
+    mtxorb_batch_init(&b);
+    mtxorb_batch_gotoxy(&b, x, next_int(in));
+    next_text(in, s);
+    mtxorb_batch_puts(&b, s);
+    mtxorb_batch_putc(&b, next(in));
+    mtxorb_batch_commit(h, &b);
+}
+
+static void run_fb_put(MTXORB *h, struct input *in)
+{
+    char s[TEXT_MAX + 1];
+    int x = next_int(in);
+    int y = next_int(in);
+
+    next_text(in, s);
+    mtxorb_fb_put(h, x, y, s);
+}
+
+static void run_fb_bars(MTXORB *h, struct input *in)
+{
+    int x = next_int(in);
+    int y = next_int(in);
+    int size = next_int(in);
+    int len = next_int(in);
+
+    if (next(in) & 1)
+        mtxorb_fb_vbar(h, x, y, size, len);
+    else
+        mtxorb_fb_hbar(h, x, y, size, len, (next(in) & 1) ? MTXORB_LEFT : MTXORB_RIGHT);
+}
+
+static void run_fb_bigstr(MTXORB *h, struct input *in)
+{
+    char s[TEXT_MAX + 1];
+    int x = next_int(in);
+    int y = next_int(in);
+
+    next_text(in, s);
+    mtxorb_fb_bigstr(h, x, y, s);
+}
+
+static void run_widget(MTXORB *h, struct input *in)
+{
+    char s[TEXT_MAX + 1];
+    int x = next_int(in);
+    int y = next_int(in);
+    int id = mtxorb_widget_label(h, x, y, next_int(in), MTXORB_ALIGN_LEFT);
+
+    next_text(in, s);
+    mtxorb_widget_set_text(h, id, s);
+}
+
+static void run_fb_present(MTXORB *h, struct input *in)
+{
+    (void)in;
+    mtxorb_fb_present(h);
+}
+
+/* Settings, most of them depend on the display type */
+static void run_setting(MTXORB *h, struct input *in)
+{
+    int which = next(in);
+    int value = next_int(in);
+    enum mtxorb_onoff on = (value & 1) ? MTXORB_ON : MTXORB_OFF;
+
+    switch (which % 12) {
+    case 0:
+        mtxorb_set_contrast(h, value);
+        break;
+    case 1:
+        mtxorb_set_brightness(h, value);
+        break;
+    case 2:
+        mtxorb_set_bg_color(h, value, next_int(in), next_int(in));
+        break;
+    case 3:
+        mtxorb_set_keypad_brightness(h, value);
+        break;
+    case 4:
+        mtxorb_keypad_backlight_off(h);
+        break;
+    case 5:
+        mtxorb_set_key_auto_repeat(h, on);
+        break;
+    case 6:
+        mtxorb_set_key_debounce_time(h, value);
+        break;
+    case 7:
+        mtxorb_backlight_off(h);
+        break;
+    case 8:
+        mtxorb_set_cursor_block(h, on);
+        break;
+    case 9:
+        mtxorb_set_cursor_uline(h, on);
+        break;
+    case 10:
+        mtxorb_set_auto_scroll(h, on);
+        break;
+    default:
+        mtxorb_set_auto_line_wrap(h, on);
+        break;
+    }
+}
+
+#ifdef MTXORB_LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+
+    check_glyphs();
+    check_bars();
+    check_bignum();
+
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fuzz_one(data, size);
+
+    return 0;
+}
+
+#else
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-n runs] [-s seed] [file...]\n"
+            "Runs the files as inputs, or without files, random inputs.\n"
+            "  -n  number of random inputs (default: 100000)\n"
+            "  -s  seed for the random inputs (default: 1)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    static unsigned char data[4096];
+    FILE *f;
+    long runs = 100000, i;
+    unsigned int seed = 1;
+    size_t size, k;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            runs = atol(optarg);
+            break;
+        case 's':
+            seed = (unsigned int)atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    check_glyphs();
+    check_bars();
+    check_bignum();
+
+    if (optind < argc) {
+        for (; optind < argc; optind++) {
+            if ((f = fopen(argv[optind], "rb")) == NULL) {
+                perror(argv[optind]);
+                return EXIT_FAILURE;
+            }
+            size = fread(data, 1, sizeof(data), f);
+            fclose(f);
+            fuzz_one(data, size);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    srand(seed);
+    for (i = 0; i < runs; i++) {
+        size = rand() % 256;
+        for (k = 0; k < size; k++)
+            data[k] = (unsigned char)rand();
+        fuzz_one(data, size);
+    }
+
+    printf("glyph checks passed, %ld inputs, no escaped text\n", runs);
+
+    return EXIT_SUCCESS;
+}
+
+#endif /* MTXORB_LIBFUZZER */
@@ -0,0 +1,208 @@
+/* posix_openpt() and the POSIX clocks are hidden when compiling with -std=c89 */
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mtxorb.h"
+
+
+static const struct mtxorb_device_info micro_info = {
+    20,         /* Columns */
+    4,          /* Rows */
+    5,          /* Cellwidth */
+    8,          /* Cellheight */
+    MTXORB_LKD  /* Device type */
+};
+
+struct micro {
+    const char *name;
+    void (*call)(MTXORB *h, long i);
+};
+
+static double now_ns(void);
+static MTXORB *sink_open(int *master);
+static void run(const struct micro *m, MTXORB *h, long calls);
+
+static void call_puts(MTXORB *h, long i);
+static void call_puts_fe(MTXORB *h, long i);
+static void call_gotoxy(MTXORB *h, long i);
+static void call_custom_char(MTXORB *h, long i);
+static void call_fb_diff(MTXORB *h, long i);
+static void call_fb_repaint(MTXORB *h, long i);
+static void call_fb_plan(MTXORB *h, long i);
+
+static const struct micro micros[] = {
+    { "puts", call_puts },                  /* 20 characters of plain text */
+    { "puts-fe", call_puts_fe },            /* the same with 0xFE to replace */
+    { "gotoxy", call_gotoxy },
+    { "custom-char", call_custom_char },    /* glyph rows masked to the cell width */
+    { "fb-diff", call_fb_diff },            /* one cell changed per frame */
+    { "fb-repaint", call_fb_repaint },      /* every cell sent again */
+    { "fb-plan", call_fb_plan }             /* planning four scattered cells, nothing sent */
+};
+
+
+int main(int argc, char *argv[])
+{
+    MTXORB *h;
+    long calls = 200000;
+    int opt, i, master;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            calls = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n calls]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (calls <= 0) {
+        fprintf(stderr, "calls must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((h = sink_open(&master)) == NULL) {
+        perror("sink");
+        return EXIT_FAILURE;
+    }
+
+    printf("%dx%d display, buffered output into /dev/null, %ld calls per run\n\n",
+           micro_info.width, micro_info.height, calls);
+    printf("%-12s %10s %12s %12s\n", "encoder", "ns/call", "bytes/call", "writes/call");
+
+    for (i = 0; i < (int)(sizeof(micros) / sizeof(micros[0])); i++)
+        run(&micros[i], h, calls);
+
+    mtxorb_close(h);
+    close(master);
+
+    return EXIT_SUCCESS;
+}
+
+/* Time one encoder and print a row. Output is buffered, so a row costs the
+ * encoding plus a write per full queue, not a system call per call. */
+static void run(const struct micro *m, MTXORB *h, long calls)
+{
+    struct mtxorb_stats st0, st1;
+    double t0, t1;
+    long i;
+
+    /* Warm up and start from a known screen */
+    mtxorb_fb_clear(h);
+    for (i = 0; i < 1000; i++)
+        m->call(h, i);
+    mtxorb_flush(h);
+
+    mtxorb_get_stats(h, &st0);
+    t0 = now_ns();
+    for (i = 0; i < calls; i++)
+        m->call(h, i);
+    mtxorb_flush(h);
+    t1 = now_ns();
+    mtxorb_get_stats(h, &st1);
+
+    printf("%-12s %10.1f %12.1f %12.3f\n", m->name, (t1 - t0) / calls,
+           (double)(st1.bytes_written - st0.bytes_written) / calls,
+           (double)(st1.write_calls - st0.write_calls) / calls);
+}
+
+/* Open a display on a pty, then point its descriptor at /dev/null. The
+ * port is set up as usual, but the output costs no more than a write. */
+static MTXORB *sink_open(int *master)
+{
+    MTXORB *h;
+    int null;
+
+    if ((*master = posix_openpt(O_RDWR | O_NOCTTY)) == -1)
+        return NULL;
+
+    if ((grantpt(*master) == -1) || (unlockpt(*master) == -1) ||
+        ((h = mtxorb_open(ptsname(*master), 115200, &micro_info)) == NULL)) {
+        close(*master);
+        return NULL;
+    }
+
+    if ((null = open("/dev/null", O_WRONLY)) == -1) {
+        mtxorb_close(h);
+        close(*master);
+        return NULL;
+    }
+
+    dup2(null, mtxorb_get_fd(h));
+    close(null);
+    mtxorb_set_buffered(h, MTXORB_ON, 0);
+
+    return h;
+}
+
+/* ----- Encoders ----- */
+
+static void call_puts(MTXORB *h, long i)
+{
+    (void)i;
+    mtxorb_puts(h, "The quick brown fox ");
+}
+
+static void call_puts_fe(MTXORB *h, long i)
+{
+    (void)i;
+    mtxorb_puts(h, "The \xFEquick \xFE" "brown \xFE" "fox");
+}
+
+static void call_gotoxy(MTXORB *h, long i)
+{
+    mtxorb_gotoxy(h, (int)(i % 20), (int)((i / 20) % 4));
+}
+
+static void call_custom_char(MTXORB *h, long i)
+{
+    char glyph[8];
+    int row;
+
+    for (row = 0; row < 8; row++)
+        glyph[row] = (char)(i + row);
+
+    mtxorb_set_custom_char(h, (int)(i % 8), glyph);
+}
+
+static void call_fb_diff(MTXORB *h, long i)
+{
+    /* Each pass over the screen writes the next digit, so every cell changes */
+    mtxorb_fb_putc(h, (int)(i % 20), (int)((i / 20) % 4), (char)('0' + (i / 80) % 10));
+    mtxorb_fb_present(h);
+}
+
+static void call_fb_repaint(MTXORB *h, long i)
+{
+    mtxorb_fb_putc(h, 0, 0, (char)('0' + i % 10));
+    mtxorb_fb_invalidate(h);
+    mtxorb_fb_present(h);
+}
+
+static void call_fb_plan(MTXORB *h, long i)
+{
+    char c = (char)('a' + i % 26);
+
+    mtxorb_fb_putc(h, 1, 0, c);
+    mtxorb_fb_putc(h, 8, 1, c);
+    mtxorb_fb_putc(h, 9, 1, c);
+    mtxorb_fb_putc(h, 17, 3, c);
+    mtxorb_fb_cost(h);
+}
+
+static double now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
@@ -11,15 +11,28 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+/* POSIX and BSD interfaces are hidden when compiling with -std=c89 */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <time.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/termios.h>
 #include <sys/poll.h>
 #include <sys/errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "mtxorb.h"
 
@@ -28,103 +41,631 @@
 #define MAX_CELLWIDTH 5
 #define MAX_CELLHEIGHT 8
 #define MAX_CC 8 /* max. number of custom characters */
+#define GPO_COUNT 6 /* max. number of general purpose outputs */
+#define GPO_ALL ((1 << GPO_COUNT) - 1)
+
+#define PUTS_IOV_MAX 16 /* segments per writev() in mtxorb_puts */
+#define OUTBUF_SIZE 512 /* size of the per-handle output queue */
+#define FRAME_MAX (MAX_WIDTH * MAX_HEIGHT * 5) /* worst case bytes of a framebuffer update */
+#define SHADOW_UNKNOWN '\xFE' /* shadow cell of unknown content */
+#define FULL_BLOCK 0xFF /* all pixels set, in the character ROM */
+#define RING_SIZE 4096 /* size of the async command ring, must be a power of 2 */
+#define KEY_RING_SIZE 32 /* number of buffered key events */
+#define GROUP_MAX 16 /* max. number of displays in a group */
+#define RESUME_SIZE 16 /* longer than any command */
+#define WIDGET_MAX 16 /* max. number of widgets per display */
+#define WIDGET_TEXT_MAX 128 /* longer text is cut off */
+#define MARQUEE_GAP 3 /* blanks between the end and the start of a scrolling text */
+#define PORTNAME_MAX 256 /* longest port name kept for mtxorb_reconnect() */
+#define PROBE_TIMEOUT 500 /* ms for probing at open */
+#define QUERY_SETTLE 20 /* ms for key bytes in flight, e.g. an FTDI latency timer */
+#define QUERY_LATE 1000 /* ms the rest of a timed out reply is kept out of the key events */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define BIG_KINDS "FULBD" /* glyphs of the big characters, see big_chars */
 
-#define IS_LCD_TYPE (p->device->type == MTXORB_LCD)
-#define IS_LKD_TYPE (p->device->type == MTXORB_LKD)
-#define IS_VFD_TYPE (p->device->type == MTXORB_VFD)
-#define IS_VKD_TYPE (p->device->type == MTXORB_VKD)
+/* Capabilities of the display type, looked up once at open */
+#define CAP_KEYPAD     0x01 /* keypad settings, numbered outputs (LKD, VKD) */
+#define CAP_CONTRAST   0x02 /* LCD, LKD */
+#define CAP_BRIGHTNESS 0x04 /* VFD, VKD */
+#define CAP_RGB        0x08 /* backlight color and keypad backlight (LKD) */
+
+#define HAS_CAP(p, cap) (((p)->caps & (cap)) != 0)
+
+/* The hot fields of the handle, up to and including this one, are meant to
+ * share a cache line */
+#define CACHE_LINE 64
+
+/* Arbitrary baud rates are set through termios2 on Linux. <asm/termbits.h>
+ * clashes with <termios.h>, so the structure is declared here, for the
+ * architectures that use the asm-generic layout. */
+#if defined(__linux__) && defined(TCGETS2) && \
+    (defined(__x86_64__) || defined(__i386__) || defined(__arm__) || \
+     defined(__aarch64__) || defined(__riscv))
+#define HAVE_TERMIOS2 1
+#define K_BOTHER 0010000
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#else
+#define HAVE_TERMIOS2 0
+#endif
 
-/* Alias for ignoring the warning -Wunused-result for write() */
+/* Alias for ignoring the warning -Wunused-result for write(). Only for the
+ * wake pipe, the port goes through mtxorb_write_some(). */
 #define Write(fd, buf, n) ((void)!write(fd, buf, n))
 
+/* Shared indices of the async ring, see mtxorb_ring_push() */
+#define LOAD_ACQUIRE(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#define LOAD_SEQ(v) __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define STORE_SEQ(v, x) __atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+
+/* Write counters are also updated by the writer thread */
+#define STAT_ADD(v, x) ((void)__atomic_fetch_add(&(v), (x), __ATOMIC_RELAXED))
+#define STAT_LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+/* Output of a handle opened thread-safe is serialized by its mutex */
+#define LOCK(p) ((p)->threadsafe ? (void)pthread_mutex_lock(&(p)->lock) : (void)0)
+#define UNLOCK(p) ((p)->threadsafe ? (void)pthread_mutex_unlock(&(p)->lock) : (void)0)
+
 enum mtxorb_cc_mode
 {
+    cc_unknown,
     cc_hbar,
-    cc_vbar,
-    cc_bignum,
+    cc_vbar_narrow,
+    cc_vbar_wide,
+    cc_bignum_medium,
+    cc_bignum_large,
     cc_custom
 };
 
+/* Last known state of the display's settings, -1 if unknown.
+ * Setters return early when the value is already in effect. */
+struct mtxorb_state
+{
+    int cursor_block;
+    int cursor_uline;
+    int auto_scroll;
+    int line_wrap;
+    int contrast;
+    int brightness;
+    long bg_color;          /* 0xRRGGBB */
+    int keypad_brightness;
+    int gpo;                /* bitmap of output states */
+    int gpo_known;          /* bitmap of outputs whose state is known */
+    int key_debounce;
+    int key_auto_repeat;
+};
+
+/* Idempotent settings whose queued command is replaced by a newer value */
+enum mtxorb_setting
+{
+    st_cursor_block,
+    st_cursor_uline,
+    st_contrast,
+    st_brightness,
+    st_bg_color,
+    st_keypad_brightness,
+    st_key_auto_repeat,
+    st_key_debounce,
+    st_gpo, /* one per output, st_gpo + 0-5 */
+    st_count = st_gpo + 6
+};
+
+/* A slot of the custom character bank as the library believes it is */
+struct mtxorb_glyph_slot
+{
+    int valid;
+    unsigned long last_used;
+    unsigned char data[MAX_CELLHEIGHT];
+};
+
+/* Models known by mtxorb_probe(), by module type code */
+struct mtxorb_model
+{
+    int type;
+    const char *name;
+    struct mtxorb_device_info info;
+};
+
+static const struct mtxorb_model models[] = {
+    {0x01, "LCD0821", {8, 2, 5, 8, MTXORB_LCD}},
+    {0x03, "LCD2021", {20, 2, 5, 8, MTXORB_LCD}},
+    {0x04, "LCD1641", {16, 4, 5, 8, MTXORB_LCD}},
+    {0x05, "LCD2041", {20, 4, 5, 8, MTXORB_LCD}},
+    {0x06, "LCD4021", {40, 2, 5, 8, MTXORB_LCD}},
+    {0x07, "LCD4041", {40, 4, 5, 8, MTXORB_LCD}},
+    {0x08, "LK202-25", {20, 2, 5, 8, MTXORB_LKD}},
+    {0x09, "LK204-25", {20, 4, 5, 8, MTXORB_LKD}},
+    {0x0A, "LK404-55", {40, 4, 5, 8, MTXORB_LKD}},
+    {0x0B, "VFD2021", {20, 2, 5, 8, MTXORB_VFD}},
+    {0x0C, "VFD2041", {20, 4, 5, 8, MTXORB_VFD}},
+    {0x0D, "VFD4021", {40, 2, 5, 8, MTXORB_VFD}},
+    {0x0E, "VK202-25", {20, 2, 5, 8, MTXORB_VKD}},
+    {0x0F, "VK204-25", {20, 4, 5, 8, MTXORB_VKD}},
+    {0x31, "LK404-AT", {40, 4, 5, 8, MTXORB_LKD}},
+    {0x32, "VFD1621", {16, 2, 5, 8, MTXORB_VFD}},
+    {0x33, "LK402-12", {40, 2, 5, 8, MTXORB_LKD}},
+    {0x34, "LK162-12", {16, 2, 5, 8, MTXORB_LKD}},
+    {0x35, "LK204-25PC", {20, 4, 5, 8, MTXORB_LKD}},
+    {0x36, "LK202-24-USB", {20, 2, 5, 8, MTXORB_LKD}},
+    {0x37, "VK202-24-USB", {20, 2, 5, 8, MTXORB_VKD}},
+    {0x38, "LK204-24-USB", {20, 4, 5, 8, MTXORB_LKD}},
+    {0x39, "VK204-24-USB", {20, 4, 5, 8, MTXORB_VKD}}
+};
+
+#define MODEL_COUNT ((int)(sizeof(models) / sizeof(models[0])))
+
+/* Big characters, 2 rows of cells. F = full cell, U = bar at the top,
+ * L = bar at the bottom, B = both bars, D = dot, ' ' = blank. */
+static const struct
+{
+    char c;
+    const char *rows[2];
+} big_chars[] =
+{
+    { '0', { "FUF", "FLF" } },
+    { '1', { "UF ", "LFL" } },
+    { '2', { "BBF", "FLL" } },
+    { '3', { "BBF", "LLF" } },
+    { '4', { "FLF", "  F" } },
+    { '5', { "FBB", "LLF" } },
+    { '6', { "FBB", "FLF" } },
+    { '7', { "UUF", "  F" } },
+    { '8', { "FBF", "FLF" } },
+    { '9', { "FBF", "LLF" } },
+    { '-', { "LLL", "   " } },
+    { ':', { "D", "D" } },
+    { ' ', { " ", " " } }
+};
+
+/* Built-in icons, indexed by enum mtxorb_icon */
+static const unsigned char icons[][MAX_CELLHEIGHT] =
+{
+    { 0x00, 0x0A, 0x1F, 0x1F, 0x1F, 0x0E, 0x04, 0x00 },    /* heart */
+    { 0x04, 0x0E, 0x0E, 0x0E, 0x1F, 0x00, 0x04, 0x00 },    /* bell */
+    { 0x04, 0x0E, 0x15, 0x04, 0x04, 0x04, 0x04, 0x00 },    /* arrow up */
+    { 0x04, 0x04, 0x04, 0x04, 0x15, 0x0E, 0x04, 0x00 },    /* arrow down */
+    { 0x00, 0x01, 0x03, 0x16, 0x1C, 0x08, 0x00, 0x00 },    /* check */
+    { 0x00, 0x1B, 0x0E, 0x04, 0x0E, 0x1B, 0x00, 0x00 },    /* cross */
+    { 0x0E, 0x11, 0x11, 0x1F, 0x1B, 0x1B, 0x1F, 0x00 },    /* lock */
+    { 0x06, 0x09, 0x09, 0x06, 0x00, 0x00, 0x00, 0x00 }     /* degree */
+};
+
+enum mtxorb_widget_type
+{
+    wd_free,
+    wd_label,
+    wd_marquee,
+    wd_number
+};
+
+/* A text region of the framebuffer, redrawn when its content changed */
+struct mtxorb_widget
+{
+    enum mtxorb_widget_type type;
+    int x, y, width;
+    int align;              /* labels */
+    int decimals;           /* numeric fields */
+    int dirty;
+    size_t len;
+    char text[WIDGET_TEXT_MAX + 1];
+
+    /* Marquees */
+    size_t offset;          /* first char shown */
+    long step_ms;
+    unsigned long next_step;
+};
+
+struct mtxorb_priv;
+
+/* Displays driven by one epoll loop */
+struct mtxorb_group
+{
+    int epfd;
+    int count;
+    struct mtxorb_priv *members[GROUP_MAX];
+    unsigned int events[GROUP_MAX]; /* events currently registered */
+};
+
 struct mtxorb_priv
 {
-    int fd; /* File descriptor */
+    /* Hot fields, used by nearly every call. Keep them first and within
+     * CACHE_LINE bytes, see mtxorb_hot_fits below. */
+    int fd;         /* File descriptor */
+    unsigned int caps;  /* CAP_* of the display type */
+    int api;        /* public function producing the output, for the trace */
 
-    struct termios oldtio;
+    /* Tracked cursor position, -1 if unknown */
+    int cur_x;
+    int cur_y;
 
     /* Keep track of hbar, vbar, num, custom chars
      * mode, so we don't re-initialize on subsequent
      * calls.
     */
-    enum mtxorb_cc_mode current_cc_mode;
+    enum mtxorb_cc_mode cc_mode;
+
+    int buffered;   /* output goes to the queue, see mtxorb_set_buffered() */
+    int nonblock;   /* the port is non-blocking, mtxorb_flush() leaves what
+                     * it doesn't take in the queue */
+    int async;      /* output goes to the ring, see mtxorb_set_async() */
+    int threadsafe; /* output is serialized by 'lock' */
+
+    /* Output queue, only used in buffered mode */
+    size_t outoff;  /* start of the part not written yet */
+    size_t outlen;
+    size_t high_water;
+
+    /* Copy of the info passed to mtxorb_open() */
+    struct mtxorb_device_info device;
+
+    int allocated; /* Freed by mtxorb_close(), not opened in caller storage */
+
+    /* How the port was opened, for mtxorb_reconnect() */
+    char portname[PORTNAME_MAX];
+    struct mtxorb_open_options opts;
+    struct termios oldtio;
+
+    /* Set when the port hung up, and when output was lost because of a
+     * failed write. Also set by the writer thread. */
+    int hangup;
+    int dropped;
+    int resume_async;   /* async was on when a reconnect failed */
+
+    struct mtxorb_state state;
+
+    /* Custom character bank, for finding resident glyphs by content */
+    struct mtxorb_glyph_slot cc_bank[MAX_CC];
+    unsigned long cc_clock;
+
+    int baudrate; /* current speed of the port */
+
+    unsigned char outbuf[OUTBUF_SIZE];
+
+    /* Member of a group, the queue is drained by mtxorb_group_run() */
+    int grouped;
+    int fd_flags;   /* file status flags before joining the group */
+    int group_nonblock;         /* output mode before joining the group */
+    int group_buffered;
+    size_t group_high_water;
+
+    /* Where the display's command parser is in the bytes written so far:
+     * 0 between commands, -1 waiting for an opcode, else number of argument
+     * bytes missing. A write that fails in the middle of a command keeps
+     * the rest of it in 'resume', to be written before anything else. */
+    int wire_left;
+    size_t resume_len;
+    unsigned char resume[RESUME_SIZE];
+
+    /* Pacing, see 'pace_us' of the open options. 'wire_op' is the opcode of
+     * the command the parser is in, 'pace_due' when writing may go on. */
+    unsigned long pace_us;
+    unsigned char wire_op;
+    unsigned long pace_due;
+
+    /* errno of the last failed write, reported by mtxorb_flush() */
+    int error;
+
+    /* Offset of the queued command of each setting, -1 if none */
+    int pending[st_count];
+
+    /* Shadow framebuffer. 'fb' holds the frame being built, 'shadow'
+     * what was last sent to the display. Unknown cells of the shadow are
+     * SHADOW_UNKNOWN, which never appears in 'fb'. */
+    char fb[MAX_HEIGHT][MAX_WIDTH];
+    char shadow[MAX_HEIGHT][MAX_WIDTH];
+
+    /* Refresh scheduler, see mtxorb_fb_tick() */
+    unsigned char prio[MAX_HEIGHT][MAX_WIDTH]; /* high-priority cells */
+    int fps;                /* refresh rate, 0 = no rate limit */
+    long frame_ms;          /* frame interval, 0 = no rate limit */
+    size_t frame_budget;    /* max. bytes per frame, from fps and the baud rate */
+    unsigned long next_frame;
 
-    struct mtxorb_device_info *device;
+    /* Widgets, drawn into the framebuffer before a frame is sent */
+    struct mtxorb_widget widgets[WIDGET_MAX];
+
+    /* Thread-safe mode. The mutex is recursive and guards the output queue,
+     * the ring producer and the trace. 'cursor_lost' is set by batches from
+     * other threads, the cursor is unknown at the next frame. */
+    pthread_mutex_t lock;
+    int cursor_lost;
+
+    /* Async mode. The API thread is the only producer of the ring and the
+     * writer thread the only consumer, so no locking is needed. */
+    pthread_t writer;
+    int wake[2];        /* pipe used to wake up an idle writer */
+    int writer_idle;
+    int writer_stop;
+    size_t ring_head;   /* only written by the producer */
+    size_t ring_tail;   /* only written by the writer */
+    unsigned char ring[RING_SIZE];
+
+    /* Key events read by mtxorb_process_input(), oldest dropped on overflow */
+    struct mtxorb_key_event keys[KEY_RING_SIZE];
+    unsigned int key_head;
+    unsigned int key_tail;
+
+    /* Reply bytes still to come after a query timed out, and until when */
+    size_t late_reply;
+    unsigned long late_until;
+
+    struct mtxorb_stats stats;
+
+    /* Trace of the output, see mtxorb_trace_open() */
+    FILE *trace;
+    unsigned long trace_last;   /* time of the last record in us */
 };
 
+/* Fails to compile when the handle outgrows MTXORB_HANDLE_SIZE */
+typedef char mtxorb_handle_fits[(sizeof(struct mtxorb_priv) <= MTXORB_HANDLE_SIZE) ? 1 : -1];
+
+/* Fails to compile when the hot fields spill into a second cache line */
+typedef char mtxorb_hot_fits[(offsetof(struct mtxorb_priv, device) <= CACHE_LINE) ? 1 : -1];
+
+static void mtxorb_emit(struct mtxorb_priv *p, const void *buf, size_t n);
+static void mtxorb_emitv(struct mtxorb_priv *p, const struct iovec *iov, int cnt);
+static void mtxorb_emit_as(struct mtxorb_priv *p, int api, const struct iovec *iov, int cnt);
+static void mtxorb_queuev(struct mtxorb_priv *p, const struct iovec *iov, int cnt, size_t n);
+static void mtxorb_emit_setting(struct mtxorb_priv *p, enum mtxorb_setting st, const void *buf, size_t n);
+static void mtxorb_drop_pending(struct mtxorb_priv *p);
+static void mtxorb_forget_outputs(struct mtxorb_priv *p, const unsigned char *buf, size_t n);
+static int mtxorb_drain(struct mtxorb_priv *p);
+static void mtxorb_make_room(struct mtxorb_priv *p, size_t n);
+static void mtxorb_update_rate(struct mtxorb_priv *p);
+static void mtxorb_drop_glyphs(struct mtxorb_priv *p);
+static int mtxorb_glyph_shown(struct mtxorb_priv *p, int id);
+static int mtxorb_bar_glyph(struct mtxorb_priv *p, int fill, int size, int dir);
+static int mtxorb_big_char(struct mtxorb_priv *p, int x, int y, char c, int *ids);
+static int mtxorb_widget_new(struct mtxorb_priv *p, enum mtxorb_widget_type type, int x, int y, int width);
+static void mtxorb_widgets_update(struct mtxorb_priv *p, unsigned long now);
+static int mtxorb_widgets_dirty(struct mtxorb_priv *p);
+static long mtxorb_widgets_next_step(struct mtxorb_priv *p, unsigned long now);
+static void mtxorb_widget_draw(struct mtxorb_priv *p, struct mtxorb_widget *w);
+static int mtxorb_big_glyph(struct mtxorb_priv *p, char kind, int *ids);
+static void mtxorb_xmit(struct mtxorb_priv *p, const void *buf, size_t n);
+static void mtxorb_xmitv(struct mtxorb_priv *p, const struct iovec *iov, int cnt);
+static void mtxorb_ring_push(struct mtxorb_priv *p, const unsigned char *buf, size_t n);
+static void mtxorb_wake_writer(struct mtxorb_priv *p);
+static void *mtxorb_writer(void *arg);
+static void mtxorb_cursor_advance(struct mtxorb_priv *p, int *x, int *y, int n);
+static void mtxorb_check_cursor(struct mtxorb_priv *p);
+static size_t mtxorb_fb_plan(struct mtxorb_priv *p, unsigned char *out, size_t n, size_t budget,
+                             int prio_only, int *cur_x, int *cur_y);
+static unsigned long mtxorb_now_ms(void);
 static void mtxorb_set_key_auto_tx(MTXORB *handle, enum mtxorb_onoff on);
+static int mtxorb_switch_async(struct mtxorb_priv *p, enum mtxorb_onoff on);
+static speed_t mtxorb_baud_to_speed(int baudrate);
+static void mtxorb_set_low_latency(int fd);
+static void mtxorb_set_ftdi_latency(const char *portname, int latency);
+static void mtxorb_flush_all(struct mtxorb_priv *p);
+static int mtxorb_send_queue(struct mtxorb_priv *p);
+static int mtxorb_take_error(struct mtxorb_priv *p);
+static void mtxorb_write_all(struct mtxorb_priv *p, const unsigned char *buf, size_t n);
+static void mtxorb_writev_all(struct mtxorb_priv *p, const struct iovec *iov, int cnt);
+static size_t mtxorb_write_some(struct mtxorb_priv *p, const unsigned char *buf, size_t n, int block, int *err);
+static void mtxorb_save_resume(struct mtxorb_priv *p, const unsigned char *buf, size_t n);
+static void mtxorb_pad_resume(struct mtxorb_priv *p);
+static ssize_t mtxorb_sys_write(struct mtxorb_priv *p, const void *buf, size_t n);
+static ssize_t mtxorb_sys_writev(struct mtxorb_priv *p, const struct iovec *iov, int cnt);
+static void mtxorb_count_commands(struct mtxorb_priv *p, const unsigned char *buf, size_t n);
+static int mtxorb_cmd_args(struct mtxorb_priv *p, unsigned char op);
+static size_t mtxorb_fb_repaint_cost(struct mtxorb_priv *p);
+static void mtxorb_trace_record(struct mtxorb_priv *p, int api, const unsigned char *buf, size_t n);
+static void mtxorb_batch_add(struct mtxorb_batch *b, const void *buf, size_t n);
+static unsigned long mtxorb_now_us(void);
+static int mtxorb_set_port_speed(int fd, int baudrate);
 static int mtxorb_validate_device_info(const struct mtxorb_device_info *info);
+static unsigned int mtxorb_device_caps(enum mtxorb_type type);
+static struct mtxorb_priv *mtxorb_setup(struct mtxorb_priv *p, const char *portname, int baudrate,
+                                        const struct mtxorb_device_info *info,
+                                        const struct mtxorb_open_options *opts);
+static int mtxorb_open_port(const char *portname, int baudrate, const struct mtxorb_open_options *opts,
+                            struct termios *oldtio);
+static void mtxorb_replay_state(struct mtxorb_priv *p, int warm);
+static int mtxorb_is_hangup(int err);
+static size_t mtxorb_queue_keys(struct mtxorb_priv *p, const unsigned char *buf, size_t n);
+static int mtxorb_late_reply(struct mtxorb_priv *p);
+static size_t mtxorb_read_until(struct mtxorb_priv *p, unsigned char *buf, size_t n, const struct timespec *deadline);
+static void mtxorb_deadline(struct timespec *deadline, int ms);
+static int mtxorb_ms_left(const struct timespec *deadline);
+static void mtxorb_send_now(struct mtxorb_priv *p, const unsigned char *buf, size_t n);
+static int mtxorb_is_slow(unsigned char op);
+static size_t mtxorb_pace_cut(struct mtxorb_priv *p, const struct iovec *iov, int cnt);
+static void mtxorb_pace_wait(struct mtxorb_priv *p);
+static long mtxorb_pace_left(struct mtxorb_priv *p);
+static int mtxorb_pace_nowait(struct mtxorb_priv *p);
 
+void mtxorb_init_open_options(struct mtxorb_open_options *opts)
+{
+    opts->low_latency = 0;
+    opts->ftdi_latency = 0;
+    opts->nonblock = 0;
+    opts->vmin = 1;
+    opts->vtime = 0;
+    opts->threadsafe = 0;
+    opts->flow_control = MTXORB_FLOW_NONE;
+    opts->pace_us = 0;
+}
+
+#ifndef MTXORB_NO_MALLOC
 MTXORB *mtxorb_open(const char *portname, int baudrate, const struct mtxorb_device_info *info)
 {
-    struct mtxorb_priv *p;
-    struct termios oldtio, newtio;
-    int fd;
-    int speed;
+    return mtxorb_open_ex(portname, baudrate, info, NULL);
+}
+
+MTXORB *mtxorb_open_ex(const char *portname, int baudrate, const struct mtxorb_device_info *info,
+                       const struct mtxorb_open_options *opts)
+{
+    return mtxorb_setup(NULL, portname, baudrate, info, opts);
+}
+#endif /* MTXORB_NO_MALLOC */
 
-    if ((info == NULL) || (mtxorb_validate_device_info(info) != 0))
+MTXORB *mtxorb_open_static(void *storage, size_t size, const char *portname, int baudrate,
+                           const struct mtxorb_device_info *info,
+                           const struct mtxorb_open_options *opts)
+{
+    if ((storage == NULL) || (size < sizeof(struct mtxorb_priv)))
     {
         errno = EINVAL;
         return NULL;
     }
 
-    switch (baudrate)
+    return mtxorb_setup(storage, portname, baudrate, info, opts);
+}
+
+size_t mtxorb_handle_size(void)
+{
+    return sizeof(struct mtxorb_priv);
+}
+
+/* Open the port and set up the handle in p, or in allocated memory if p is
+ * NULL */
+static struct mtxorb_priv *mtxorb_setup(struct mtxorb_priv *p, const char *portname, int baudrate,
+                                        const struct mtxorb_device_info *info,
+                                        const struct mtxorb_open_options *opts)
+{
+    struct mtxorb_open_options defaults;
+    struct mtxorb_module module;
+    struct termios oldtio;
+    pthread_mutexattr_t attr;
+    int fd, i, err;
+
+    /* Without info the module is probed, see mtxorb_probe() */
+    if (((info != NULL) && (mtxorb_validate_device_info(info) != 0)) ||
+        (baudrate <= 0))
     {
-    case 9600:
-        speed = B9600;
-        break;
-    case 19200:
-        speed = B19200;
-        break;
-    case 38400:
-        speed = B38400;
-        break;
-    case 57600:
-        speed = B57600;
-        break;
-    default:
         errno = EINVAL;
         return NULL;
     }
 
-    if ((fd = open(portname, O_RDWR | O_NOCTTY)) == -1)
-        return NULL;
+    if (opts == NULL)
+    {
+        mtxorb_init_open_options(&defaults);
+        opts = &defaults;
+    }
 
-    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+    if ((opts->vmin < 0) || (opts->vmin > 255) ||
+        (opts->vtime < 0) || (opts->vtime > 255) ||
+        (opts->ftdi_latency < 0) || (opts->ftdi_latency > 255) ||
+        (opts->flow_control < MTXORB_FLOW_NONE) || (opts->flow_control > MTXORB_FLOW_XONXOFF) ||
+        (opts->pace_us < 0))
+    {
+        errno = EINVAL;
         return NULL;
+    }
 
-    /* Save current port settings */
-    tcgetattr(fd, &oldtio);
-
-    /* 8-N-1, blocking read by default unless using poll or select */
-    memset(&newtio, 0, sizeof(struct termios));
-    newtio.c_cflag = speed | CS8 | CLOCAL | CREAD;
-    newtio.c_iflag = IGNPAR | ICRNL;
-    newtio.c_cc[VMIN] = 1;
-    newtio.c_cc[VTIME] = 0;
+    if ((portname == NULL) || (strlen(portname) >= PORTNAME_MAX))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
 
-    /* Flush input buffer and apply new settings */
-    tcflush(fd, TCIFLUSH);
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1)
+    if ((fd = mtxorb_open_port(portname, baudrate, opts, &oldtio)) == -1)
         return NULL;
 
-    /* Allocate memory for the new handler */
-    p = malloc(sizeof(struct mtxorb_priv));
+#ifndef MTXORB_NO_MALLOC
+    /* Allocate memory for the new handler, aligned for the hot fields */
     if (p == NULL)
-        return NULL;
+    {
+        if (posix_memalign((void **)&p, CACHE_LINE, sizeof(struct mtxorb_priv)) != 0)
+        {
+            tcsetattr(fd, TCSANOW, &oldtio);
+            close(fd);
+            errno = ENOMEM;
+            return NULL;
+        }
+        p->allocated = 1;
+    }
+    else
+#endif
+        p->allocated = 0;
 
     p->fd = fd;
-    p->device = (struct mtxorb_device_info *)info;
+    strcpy(p->portname, portname);
+    p->opts = *opts;
+    p->hangup = 0;
+    p->dropped = 0;
+    p->resume_async = 0;
+    /* Until probing finds out, assume a keypad that sends key presses */
+    if (info != NULL)
+        p->device = *info;
+    else
+    {
+        p->device.width = MAX_WIDTH;
+        p->device.height = MAX_HEIGHT;
+        p->device.cellwidth = MAX_CELLWIDTH;
+        p->device.cellheight = MAX_CELLHEIGHT;
+        p->device.type = MTXORB_LKD;
+    }
+    p->caps = mtxorb_device_caps(p->device.type);
+    p->baudrate = baudrate;
     memcpy(&p->oldtio, &oldtio, sizeof(struct termios));
 
+    p->buffered = 0;
+    p->high_water = OUTBUF_SIZE;
+    p->outoff = 0;
+    p->outlen = 0;
+    p->grouped = 0;
+    p->nonblock = (opts->nonblock != 0);
+    p->wire_left = 0;
+    p->resume_len = 0;
+    p->pace_us = opts->pace_us;
+    p->wire_op = 0;
+    p->pace_due = 0;
+    p->error = 0;
+    mtxorb_drop_pending(p);
+
+    memset(p->fb, ' ', sizeof(p->fb));
+    memset(p->prio, 0, sizeof(p->prio));
+    p->fps = 0;
+    p->frame_ms = 0;
+    p->frame_budget = FRAME_MAX;
+    p->next_frame = 0;
+    for (i = 0; i < WIDGET_MAX; i++)
+        p->widgets[i].type = wd_free;
+    p->cur_x = -1;
+    p->cur_y = -1;
+    p->cursor_lost = 0;
+    p->threadsafe = 0;
+    if (opts->threadsafe)
+    {
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        p->threadsafe = (pthread_mutex_init(&p->lock, &attr) == 0);
+        pthread_mutexattr_destroy(&attr);
+    }
+    p->async = 0;
+    p->cc_clock = 0;
+    p->key_head = 0;
+    p->late_reply = 0;
+    p->key_tail = 0;
+    memset(&p->stats, 0, sizeof(p->stats));
+    p->trace = NULL;
+    p->api = MTXORB_API_NONE;
+    mtxorb_invalidate_state(p);
+
+    if ((info == NULL) && (mtxorb_probe(p, &module, PROBE_TIMEOUT) == -1))
+    {
+        err = errno;
+        mtxorb_close(p);
+        errno = err;
+        return NULL;
+    }
+
     mtxorb_clear(p);
     mtxorb_home(p);
     mtxorb_set_key_auto_tx(p, MTXORB_ON);
@@ -139,6 +680,13 @@ void mtxorb_close(MTXORB *handle)
     if (p == NULL)
         return;
 
+    /* Send whatever is still queued */
+    if (p->fd != -1)
+        mtxorb_flush_all(p);
+
+    /* Wait for the writer thread to drain the ring */
+    mtxorb_set_async(p, MTXORB_OFF);
+
     if (p->fd != -1)
     {
         /* Release lock */
@@ -149,394 +697,3833 @@ void mtxorb_close(MTXORB *handle)
         close(p->fd);
     }
 
-    free(p);
-}
+    mtxorb_trace_close(p);
 
-/* ----- Text functions ----- */
+    if (p->threadsafe)
+        pthread_mutex_destroy(&p->lock);
 
-void mtxorb_home(MTXORB *handle)
-{
-    mtxorb_gotoxy(handle, 0, 0);
+#ifndef MTXORB_NO_MALLOC
+    if (p->allocated)
+        free(p);
+#endif
 }
 
-void mtxorb_clear(MTXORB *handle)
+int mtxorb_reconnect(MTXORB *handle, enum mtxorb_restart restart)
 {
     struct mtxorb_priv *p = handle;
+    struct termios oldtio;
+    int async = p->async || p->resume_async;
+    int err;
 
-    Write(p->fd, "\xFE"
-                 "X",
-          2);
-}
+    /* The group's epoll set holds the old descriptor */
+    if (p->grouped)
+    {
+        errno = EBUSY;
+        return -1;
+    }
 
-void mtxorb_putc(MTXORB *handle, char c)
-{
-    struct mtxorb_priv *p = handle;
+    /* Lets the writer thread go, it drops what the dead port won't take */
+    if (p->async)
+        mtxorb_set_async(p, MTXORB_OFF);
 
-    if (c == '\xFE')
-        c = ' ';
+    LOCK(p);
 
-    Write(p->fd, &c, 1);
-}
+    if (p->fd != -1)
+    {
+        flock(p->fd, LOCK_UN);
+        close(p->fd);
+    }
 
-void mtxorb_puts(MTXORB *handle, const char *s)
-{
-    struct mtxorb_priv *p = handle;
-    char *c;
+    /* The settings saved at the first open are restored by mtxorb_close() */
+    p->fd = mtxorb_open_port(p->portname, p->baudrate, &p->opts, &oldtio);
+    if (p->fd == -1)
+    {
+        /* No writer thread on a dead descriptor, the next successful
+         * reconnect brings it back */
+        err = errno;
+        p->resume_async = async;
+        UNLOCK(p);
+        errno = err;
+        return -1;
+    }
+
+    p->resume_async = 0;
+
+    STORE_SEQ(p->hangup, 0);
+    STORE_SEQ(p->error, 0);
 
-    /* Avoid creating an intermediate buffer,
-     * so check and send bytes one by one */
-    c = (char *)s;
-    for (; *c != '\0'; ++c)
+    /* Without lost output, a display that kept its state is in sync with
+     * the cached state, only the cursor may have moved */
+    if ((restart == MTXORB_RESTART_WARM) && !LOAD_SEQ(p->dropped))
     {
-        /* Replace command prefix char with space */
-        if (*c == '\xFE')
-            Write(p->fd, " ", 1);
-        else
-            Write(p->fd, c, 1);
+        p->cur_x = -1;
+        p->cur_y = -1;
     }
-}
+    else
+        mtxorb_replay_state(p, restart == MTXORB_RESTART_WARM);
 
-void mtxorb_write(MTXORB *handle, const void *buf, size_t nbytes)
-{
-    struct mtxorb_priv *p = handle;
+    STORE_SEQ(p->dropped, 0);
+
+    UNLOCK(p);
+
+    if (async)
+        mtxorb_set_async(p, MTXORB_ON);
 
-    Write(p->fd, buf, nbytes);
+    return mtxorb_take_error(p);
 }
 
-ssize_t mtxorb_read(MTXORB *handle, void *buf, size_t nbytes, int timeout)
+int mtxorb_link_lost(MTXORB *handle)
 {
     struct mtxorb_priv *p = handle;
     struct pollfd fds[1];
 
+    if ((p->fd == -1) || LOAD_SEQ(p->hangup))
+        return 1;
+
     fds[0].fd = p->fd;
-    fds[0].events = POLLIN;
+    fds[0].events = 0;
     fds[0].revents = 0;
-    poll(fds, 1, timeout);
-    if (fds[0].revents == 0)
-        return 0;
+    if ((poll(fds, 1, 0) == 1) && (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+    {
+        STORE_SEQ(p->hangup, 1);
+        return 1;
+    }
 
-    return read(fds[0].fd, buf, nbytes);
+    return 0;
 }
 
-void mtxorb_gotoxy(MTXORB *handle, int x, int y)
+void mtxorb_set_buffered(MTXORB *handle, enum mtxorb_onoff on, size_t high_water)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 'G', 0, 0};
 
-    if ((x >= 0) && (x < p->device->width))
-        out[2] = x + 1;
-    if ((y >= 0) && (y < p->device->height))
-        out[3] = y + 1;
+    if ((high_water == 0) || (high_water > OUTBUF_SIZE))
+        high_water = OUTBUF_SIZE;
+
+    LOCK(p);
+
+    p->high_water = high_water;
+
+    if (on == MTXORB_ON)
+        p->buffered = 1;
+    else
+    {
+        mtxorb_flush_all(p);
+        p->buffered = 0;
+    }
 
-    Write(p->fd, out, 4);
+    UNLOCK(p);
 }
 
-void mtxorb_set_cursor_block(MTXORB *handle, enum mtxorb_onoff on)
+int mtxorb_flush(MTXORB *handle)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0};
+    int ret;
 
-    out[1] = (on == MTXORB_ON) ? 'S' : 'T';
-    Write(p->fd, out, 2);
+    ret = mtxorb_send_queue(p);
+
+    if (ret == 1)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return mtxorb_take_error(p);
 }
 
-void mtxorb_set_cursor_uline(MTXORB *handle, enum mtxorb_onoff on)
+size_t mtxorb_pending(MTXORB *handle)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0};
+    size_t n;
 
-    out[1] = (on == MTXORB_ON) ? 'J' : 'K';
-    Write(p->fd, out, 2);
+    LOCK(p);
+
+    n = p->outlen - p->outoff;
+    if (p->async)
+        n += p->ring_head - LOAD_ACQUIRE(p->ring_tail);
+
+    UNLOCK(p);
+
+    return n;
 }
 
-void mtxorb_set_auto_scroll(MTXORB *handle, enum mtxorb_onoff on)
+int mtxorb_set_async(MTXORB *handle, enum mtxorb_onoff on)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0};
+    int ret;
 
-    out[1] = (on == MTXORB_ON) ? 'Q' : 'R';
-    Write(p->fd, out, 2);
+    LOCK(p);
+    ret = mtxorb_switch_async(p, on);
+    UNLOCK(p);
+
+    return ret;
 }
 
-void mtxorb_set_auto_line_wrap(MTXORB *handle, enum mtxorb_onoff on)
+static int mtxorb_switch_async(struct mtxorb_priv *p, enum mtxorb_onoff on)
 {
-    struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0};
+    if ((on == MTXORB_ON) == p->async)
+        return 0;
 
-    out[1] = (on == MTXORB_ON) ? 'C' : 'D';
-    Write(p->fd, out, 2);
-}
+    if (on == MTXORB_ON)
+    {
+        /* The group writes the queue of its members itself */
+        if (p->grouped)
+        {
+            errno = EBUSY;
+            return -1;
+        }
 
-/* ----- Special characters functions ----- */
+        /* Not after a failed mtxorb_reconnect() */
+        if (p->fd == -1)
+        {
+            errno = EBADF;
+            return -1;
+        }
 
-void mtxorb_set_custom_char(MTXORB *handle, int id, const char *data)
-{
-    struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 'N', 0, 0, 0, 0, 0, 0, 0, 0, 0};
-    unsigned char mask = (1 << p->device->cellwidth) - 1;
-    int i;
+        if (pipe(p->wake) == -1)
+            return -1;
+        fcntl(p->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(p->wake[1], F_SETFL, O_NONBLOCK);
 
-    if ((data == NULL) ||
-        (id < 0) || (id >= MAX_CC))
-        return;
+        p->ring_head = 0;
+        p->ring_tail = 0;
+        p->writer_idle = 0;
+        p->writer_stop = 0;
 
-    out[2] = id;
+        if (pthread_create(&p->writer, NULL, mtxorb_writer, p) != 0)
+        {
+            close(p->wake[0]);
+            close(p->wake[1]);
+            errno = EAGAIN;
+            return -1;
+        }
 
-    for (i = 0; i < p->device->cellheight; i++)
-        out[i + 3] = data[i] & mask;
+        p->async = 1;
+    }
+    else
+    {
+        /* The writer leaves once the ring is empty */
+        STORE_SEQ(p->writer_stop, 1);
+        mtxorb_wake_writer(p);
+        pthread_join(p->writer, NULL);
 
-    Write(p->fd, out, 11);
+        close(p->wake[0]);
+        close(p->wake[1]);
+        p->async = 0;
+    }
 
-    p->current_cc_mode = cc_custom;
+    return 0;
 }
 
-void mtxorb_hbar(MTXORB *handle, int x, int y, int len, enum mtxorb_dir dir)
+int mtxorb_sync(MTXORB *handle, int timeout)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0, 0, 0, 0, 0};
+    struct timespec deadline;
 
-    if ((x < 0) || (x >= p->device->width) ||
-        (y < 0) || (y >= p->device->height) ||
-        (len < 0) || (len > 100))
-        return;
+    if (!p->async)
+        return 0;
 
-    /* Initialize the bar, replacing custom characters
-     * currently present in memory bank 0.
-     */
-    if (p->current_cc_mode != cc_hbar)
+    if (timeout > 0)
+        mtxorb_deadline(&deadline, timeout);
+
+    /* Poll the ring in 1 ms steps until the writer has caught up */
+    while (LOAD_ACQUIRE(p->ring_tail) != LOAD_SEQ(p->ring_head))
     {
-        out[1] = 'h';
-        Write(p->fd, out, 2);
+        if ((timeout == 0) || ((timeout > 0) && (mtxorb_ms_left(&deadline) == 0)))
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
 
-        p->current_cc_mode = cc_hbar;
+        poll(NULL, 0, 1);
     }
 
-    /* Place the bar */
-    out[1] = '\x7C';
-    out[2] = x + 1;
-    out[3] = y + 1;
-    out[4] = (dir == MTXORB_LEFT) ? 1 : 0;
-    out[5] = len;
-    Write(p->fd, out, 6);
+    return mtxorb_take_error(p);
 }
 
-void mtxorb_vbar(MTXORB *handle, int x, int len, enum mtxorb_vbar_style style)
+void mtxorb_invalidate_state(MTXORB *handle)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0, 0, 0};
-
-    if ((x < 0) || (x >= p->device->width) ||
-        (len < 0) || (len > 32))
-        return;
-
-    /* Initialize the bar, replacing custom characters currently present
-     * in memory. */
-    if (p->current_cc_mode != cc_vbar)
-    {
-        out[1] = (style == MTXORB_WIDE) ? 'v' : 'h';
-        Write(p->fd, out, 2);
 
-        p->current_cc_mode = cc_vbar;
-    }
+    p->state.cursor_block = -1;
+    p->state.cursor_uline = -1;
+    p->state.auto_scroll = -1;
+    p->state.line_wrap = -1;
+    p->state.contrast = -1;
+    p->state.brightness = -1;
+    p->state.bg_color = -1;
+    p->state.keypad_brightness = -1;
+    p->state.gpo = 0;
+    p->state.gpo_known = 0;
+    p->state.key_debounce = -1;
+    p->state.key_auto_repeat = -1;
+    p->cc_mode = cc_unknown;
+    mtxorb_drop_glyphs(p);
 
-    /* Place the bar */
-    out[1] = '=';
-    out[2] = x + 1;
-    out[3] = len;
-    Write(p->fd, out, 4);
+    /* Screen content and cursor are unknown as well */
+    memset(p->shadow, SHADOW_UNKNOWN, sizeof(p->shadow));
+    p->cur_x = -1;
+    p->cur_y = -1;
 }
 
-void mtxorb_bignum(MTXORB *handle, int x, int y, int digit, enum mtxorb_bignum_style style)
+int mtxorb_set_baudrate(MTXORB *handle, int baudrate)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0, 0, 0, 0};
+    unsigned char out[] = {'\xFE', '9', 0};
+    int ret;
 
-    if ((x < 0) || (x >= p->device->width) ||
-        (digit < 0) || (digit > 9))
-        return;
+    p->api = MTXORB_API_SET_BAUDRATE;
 
-    /* Initialize the bar, replacing all custom characters
-     * currently present. */
-    if (p->current_cc_mode != cc_bignum)
+    /* Speed codes of the module's change baud rate command */
+    switch (baudrate)
     {
-        out[1] = (style == MTXORB_LARGE) ? 'n' : 'm';
-        Write(p->fd, out, 2);
-
-        p->current_cc_mode = cc_bignum;
+    case 1200:
+        out[2] = 83;
+        break;
+    case 2400:
+        out[2] = 41;
+        break;
+    case 4800:
+        out[2] = 207;
+        break;
+    case 9600:
+        out[2] = 103;
+        break;
+    case 14400:
+        out[2] = 68;
+        break;
+    case 19200:
+        out[2] = 51;
+        break;
+    case 28800:
+        out[2] = 34;
+        break;
+    case 38400:
+        out[2] = 25;
+        break;
+    case 57600:
+        out[2] = 16;
+        break;
+    case 76800:
+        out[2] = 12;
+        break;
+    case 115200:
+        out[2] = 8;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
     }
 
-    /* Place the digit */
-    if (style == MTXORB_LARGE)
+    if ((mtxorb_baud_to_speed(baudrate) == B0) && !HAVE_TERMIOS2)
     {
-        out[1] = '#';
-        out[2] = x + 1;
-        out[3] = digit;
-        Write(p->fd, out, 4);
+        errno = EINVAL;
+        return -1;
     }
-    else
+
+    LOCK(p);
+
+    /* Everything queued has to go out at the old speed */
+    mtxorb_flush_all(p);
+    mtxorb_sync(p, -1);
+
+    if (p->trace != NULL)
+        mtxorb_trace_record(p, p->api, out, 3);
+    mtxorb_write_all(p, out, 3);
+    tcdrain(p->fd);
+
+    ret = mtxorb_set_port_speed(p->fd, baudrate);
+    if (ret == 0)
     {
-        if ((y < 0) || (y >= p->device->height))
-            return;
-        /* Medium sized digit */
-        out[1] = 'o';
-        out[2] = y + 1;
-        out[3] = x + 1;
-        out[4] = digit;
-        Write(p->fd, out, 5);
+        p->baudrate = baudrate;
+        /* Frames carry as many bytes as the new speed allows */
+        mtxorb_update_rate(p);
     }
+
+    UNLOCK(p);
+
+    return ret;
 }
 
-/* ----- Display functions ----- */
+void mtxorb_get_stats(MTXORB *handle, struct mtxorb_stats *stats)
+{
+    struct mtxorb_priv *p = handle;
+    int i;
 
-void mtxorb_backlight_off(MTXORB *handle)
+    memcpy(stats, &p->stats, sizeof(struct mtxorb_stats));
+
+    /* The writer thread may be updating these right now */
+    stats->bytes_written = STAT_LOAD(p->stats.bytes_written);
+    stats->write_calls = STAT_LOAD(p->stats.write_calls);
+    stats->short_writes = STAT_LOAD(p->stats.short_writes);
+    stats->failed_writes = STAT_LOAD(p->stats.failed_writes);
+    for (i = 0; i < MTXORB_LATENCY_BUCKETS; i++)
+        stats->write_latency[i] = STAT_LOAD(p->stats.write_latency[i]);
+}
+
+void mtxorb_reset_stats(MTXORB *handle)
 {
     struct mtxorb_priv *p = handle;
 
-    Write(p->fd, "\xFE"
-                 "F",
-          2);
+    memset(&p->stats, 0, sizeof(p->stats));
 }
 
-void mtxorb_set_contrast(MTXORB *handle, int value)
+int mtxorb_trace_open(MTXORB *handle, const char *path)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 'P', 0};
+    unsigned char hdr[12] = {'M', 'T', 'X', 'O', 'R', 'B', 1, 0};
+    unsigned long baud = p->baudrate;
+    FILE *f;
 
-    if ((value < 0) || (value > 255))
-        return;
+    if ((f = fopen(path, "wb")) == NULL)
+        return -1;
+
+    /* Baud rate the trace was recorded at, little-endian */
+    hdr[8] = baud & 0xFF;
+    hdr[9] = (baud >> 8) & 0xFF;
+    hdr[10] = (baud >> 16) & 0xFF;
+    hdr[11] = (baud >> 24) & 0xFF;
 
-    if (IS_LCD_TYPE || IS_LKD_TYPE)
+    if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
     {
-        out[2] = value;
-        Write(p->fd, out, 3);
+        fclose(f);
+        return -1;
     }
+
+    LOCK(p);
+    mtxorb_trace_close(p);
+    p->trace = f;
+    p->trace_last = mtxorb_now_us();
+    UNLOCK(p);
+
+    return 0;
 }
 
-void mtxorb_set_brightness(MTXORB *handle, int value)
+int mtxorb_trace_close(MTXORB *handle)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0, 0};
+    FILE *f;
 
-    if ((value < 0) || (value > 255))
-        return;
+    LOCK(p);
+    f = p->trace;
+    p->trace = NULL;
+    UNLOCK(p);
 
-    if (IS_VFD_TYPE || IS_VKD_TYPE)
-    {
-        if (value > 3)
-            value = 3;
-        out[1] = 'Y';
-    }
-    else
-        out[1] = '\x99';
+    if (f == NULL)
+        return 0;
 
-    out[2] = value;
-    Write(p->fd, out, 3);
+    return (fclose(f) == 0) ? 0 : -1;
 }
 
-void mtxorb_set_bg_color(MTXORB *handle, int r, int g, int b)
+/* ----- Text functions ----- */
+
+void mtxorb_home(MTXORB *handle)
+{
+    mtxorb_gotoxy(handle, 0, 0);
+}
+
+void mtxorb_clear(MTXORB *handle)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', '\x82', 0, 0, 0};
 
-    if (IS_LKD_TYPE)
-    {
-        out[2] = r & 0xFF;
-        out[3] = g & 0xFF;
-        out[4] = b & 0xFF;
-        Write(p->fd, out, 5);
-    }
+    p->api = MTXORB_API_CLEAR;
+
+    mtxorb_emit(p, "\xFE"
+                   "X",
+                2);
+
+    /* The display is now blank */
+    memset(p->shadow, ' ', sizeof(p->shadow));
+    p->cur_x = -1;
+    p->cur_y = -1;
 }
 
-/* ----- General Purpose Output functions ----- */
+void mtxorb_putc(MTXORB *handle, char c)
+{
+    struct mtxorb_priv *p = handle;
 
-void mtxorb_set_output(MTXORB *handle, enum mtxorb_gpo_flags flags)
+    p->api = MTXORB_API_PUTC;
+
+    if (c == '\xFE')
+        c = ' ';
+
+    mtxorb_emit(p, &c, 1);
+    mtxorb_cursor_advance(p, &p->cur_x, &p->cur_y, 1);
+}
+
+void mtxorb_puts(MTXORB *handle, const char *s)
 {
+    static const char space = ' ';
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 0, 0};
-    int i;
+    struct iovec iov[PUTS_IOV_MAX];
+    size_t len, n = 0;
+    int cnt = 0;
+
+    p->api = MTXORB_API_PUTS;
 
-    if (IS_LKD_TYPE || IS_VKD_TYPE)
+    /* Send the string straight from the caller's buffer. Runs of plain
+     * text become segments of their own, a command prefix char is replaced
+     * by a segment holding a space. */
+    while (*s != '\0')
     {
-        for (i = 0; i < 6; i++)
+        len = strcspn(s, "\xFE");
+        if (len > 0)
+        {
+            iov[cnt].iov_base = (void *)s;
+            iov[cnt].iov_len = len;
+        }
+        else
+        {
+            iov[cnt].iov_base = (void *)&space;
+            iov[cnt].iov_len = len = 1;
+        }
+
+        s += len;
+        n += len;
+
+        if (++cnt == PUTS_IOV_MAX)
         {
-            out[1] = (flags & (1 << i)) ? 'W' : 'V';
-            out[2] = i + 1;
-            Write(p->fd, out, 3);
+            mtxorb_emitv(p, iov, cnt);
+            mtxorb_cursor_advance(p, &p->cur_x, &p->cur_y, n);
+            cnt = 0;
+            n = 0;
         }
     }
-    else
+
+    if (cnt > 0)
     {
-        /* Only one output on LCD/VFD displays */
-        out[1] = (flags) ? 'W' : 'V';
-        Write(p->fd, out, 2);
+        mtxorb_emitv(p, iov, cnt);
+        mtxorb_cursor_advance(p, &p->cur_x, &p->cur_y, n);
     }
 }
 
-/* ----- Keypad functions ----- */
+void mtxorb_write(MTXORB *handle, const void *buf, size_t nbytes)
+{
+    struct mtxorb_priv *p = handle;
 
-void mtxorb_keypad_backlight_off(MTXORB *handle)
+    p->api = MTXORB_API_WRITE;
+
+    mtxorb_emit(p, buf, nbytes);
+
+    /* Raw data may contain anything */
+    p->cur_x = -1;
+    p->cur_y = -1;
+}
+
+void mtxorb_writev(MTXORB *handle, const struct iovec *iov, int iovcnt)
 {
     struct mtxorb_priv *p = handle;
 
-    if (IS_LKD_TYPE)
-        Write(p->fd, "\xFE"
-                     "\x9B",
-              2);
+    p->api = MTXORB_API_WRITEV;
+
+    if (iovcnt > 0)
+        mtxorb_emitv(p, iov, iovcnt);
+
+    p->cur_x = -1;
+    p->cur_y = -1;
 }
 
-void mtxorb_set_keypad_brightness(MTXORB *handle, int value)
+ssize_t mtxorb_read(MTXORB *handle, void *buf, size_t nbytes, int timeout)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', '\x9C', 0};
+    struct pollfd fds[1];
+
+    ssize_t n;
+
+    fds[0].fd = p->fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    poll(fds, 1, timeout);
+    if (fds[0].revents == 0)
+        return 0;
+
+    n = read(fds[0].fd, buf, nbytes);
+    if ((fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) ||
+        ((n == -1) && mtxorb_is_hangup(errno)))
+        STORE_SEQ(p->hangup, 1);
+
+    return n;
+}
+
+int mtxorb_get_fd(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+
+    return p->fd;
+}
+
+int mtxorb_process_input(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+    struct pollfd fds[1];
+    unsigned char buf[64];
+    ssize_t n;
+    int count = 0;
+
+    fds[0].fd = p->fd;
+    fds[0].events = POLLIN;
 
-    if (IS_LKD_TYPE)
+    /* Read until nothing is left, without ever blocking */
+    for (;;)
     {
-        if ((value < 0) || (value > 255))
-            return;
+        fds[0].revents = 0;
+        if (poll(fds, 1, 0) <= 0)
+            break;
+        if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+            STORE_SEQ(p->hangup, 1);
+        if (!(fds[0].revents & POLLIN))
+            break;
 
-        out[2] = value;
-        Write(p->fd, out, 3);
+        n = read(p->fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            if ((n == 0) || mtxorb_is_hangup(errno))
+                STORE_SEQ(p->hangup, 1);
+            return (count > 0) ? count : -1;
+        }
+
+        /* Late reply bytes are read but not queued */
+        count += mtxorb_queue_keys(p, buf, n);
     }
+
+    return count;
 }
 
-void mtxorb_set_key_auto_repeat(MTXORB *handle, enum mtxorb_onoff on)
+int mtxorb_next_key(MTXORB *handle, struct mtxorb_key_event *ev)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', '\x7E', 0};
 
-    if (IS_LKD_TYPE || IS_VKD_TYPE)
+    if (p->key_head == p->key_tail)
+        return 0;
+
+    if (ev != NULL)
+        *ev = p->keys[p->key_tail % KEY_RING_SIZE];
+    p->key_tail++;
+
+    return 1;
+}
+
+void mtxorb_gotoxy(MTXORB *handle, int x, int y)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 'G', 0, 0};
+
+    p->api = MTXORB_API_GOTOXY;
+
+    if ((x >= 0) && (x < p->device.width))
+        out[2] = x + 1;
+    if ((y >= 0) && (y < p->device.height))
+        out[3] = y + 1;
+
+    mtxorb_emit(p, out, 4);
+
+    if ((out[2] != 0) && (out[3] != 0))
     {
-        out[2] = (on == MTXORB_ON) ? 1 : 0;
-        Write(p->fd, out, 3);
+        p->cur_x = x;
+        p->cur_y = y;
+    }
+    else
+    {
+        p->cur_x = -1;
+        p->cur_y = -1;
     }
 }
 
-void mtxorb_set_key_debounce_time(MTXORB *handle, int value)
+void mtxorb_set_cursor_block(MTXORB *handle, enum mtxorb_onoff on)
 {
     struct mtxorb_priv *p = handle;
-    unsigned char out[] = {'\xFE', 'U', 0};
+    unsigned char out[] = {'\xFE', 0};
 
-    if ((value < 0) || (value > 255))
+    p->api = MTXORB_API_SET_CURSOR_BLOCK;
+
+    if (p->state.cursor_block == (on == MTXORB_ON))
+    {
+        p->stats.bytes_saved += 2;
         return;
+    }
+
+    out[1] = (on == MTXORB_ON) ? 'S' : 'T';
+    mtxorb_emit_setting(p, st_cursor_block, out, 2);
+
+    p->state.cursor_block = (on == MTXORB_ON);
+}
+
+void mtxorb_set_cursor_uline(MTXORB *handle, enum mtxorb_onoff on)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0};
 
-    if (IS_LKD_TYPE || IS_VKD_TYPE)
+    p->api = MTXORB_API_SET_CURSOR_ULINE;
+
+    if (p->state.cursor_uline == (on == MTXORB_ON))
     {
-        out[2] = value;
-        Write(p->fd, out, 3);
+        p->stats.bytes_saved += 2;
+        return;
     }
+
+    out[1] = (on == MTXORB_ON) ? 'J' : 'K';
+    mtxorb_emit_setting(p, st_cursor_uline, out, 2);
+
+    p->state.cursor_uline = (on == MTXORB_ON);
 }
 
-/* ------ Internal functions ----- */
+void mtxorb_set_auto_scroll(MTXORB *handle, enum mtxorb_onoff on)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0};
 
-static void mtxorb_set_key_auto_tx(MTXORB *handle, enum mtxorb_onoff on)
+    p->api = MTXORB_API_SET_AUTO_SCROLL;
+
+    if (p->state.auto_scroll == (on == MTXORB_ON))
+    {
+        p->stats.bytes_saved += 2;
+        return;
+    }
+
+    out[1] = (on == MTXORB_ON) ? 'Q' : 'R';
+    mtxorb_emit(p, out, 2);
+
+    p->state.auto_scroll = (on == MTXORB_ON);
+}
+
+void mtxorb_set_auto_line_wrap(MTXORB *handle, enum mtxorb_onoff on)
 {
     struct mtxorb_priv *p = handle;
     unsigned char out[] = {'\xFE', 0};
 
-    if (IS_LKD_TYPE || IS_VKD_TYPE)
+    p->api = MTXORB_API_SET_AUTO_LINE_WRAP;
+
+    if (p->state.line_wrap == (on == MTXORB_ON))
     {
-        out[1] = (on == MTXORB_ON) ? 'A' : 'O';
-        Write(p->fd, out, 2);
+        p->stats.bytes_saved += 2;
+        return;
+    }
+
+    out[1] = (on == MTXORB_ON) ? 'C' : 'D';
+    mtxorb_emit(p, out, 2);
+
+    p->state.line_wrap = (on == MTXORB_ON);
+}
+
+/* ----- Special characters functions ----- */
+
+void mtxorb_set_custom_char(MTXORB *handle, int id, const char *data)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 'N', 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    unsigned char mask = (1 << p->device.cellwidth) - 1;
+    int i;
+
+    p->api = MTXORB_API_SET_CUSTOM_CHAR;
+
+    if ((data == NULL) ||
+        (id < 0) || (id >= MAX_CC))
+        return;
+
+    out[2] = id;
+
+    for (i = 0; i < p->device.cellheight; i++)
+        out[i + 3] = data[i] & mask;
+
+    mtxorb_emit(p, out, 11);
+
+    /* Init of bars or big numbers wiped the rest of the bank */
+    if (p->cc_mode != cc_custom)
+        mtxorb_drop_glyphs(p);
+
+    p->cc_mode = cc_custom;
+    p->cc_bank[id].valid = 1;
+    p->cc_bank[id].last_used = ++p->cc_clock;
+    memcpy(p->cc_bank[id].data, out + 3, MAX_CELLHEIGHT);
+    p->cur_x = -1;
+    p->cur_y = -1;
+}
+
+int mtxorb_load_glyph(MTXORB *handle, const char *data)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char glyph[MAX_CELLHEIGHT];
+    unsigned char mask = (1 << p->device.cellwidth) - 1;
+    int i, id;
+
+    if (data == NULL)
+        return -1;
+
+    /* Compare the glyph as it would end up in the display's memory */
+    memset(glyph, 0, sizeof(glyph));
+    for (i = 0; i < p->device.cellheight; i++)
+        glyph[i] = data[i] & mask;
+
+    if (p->cc_mode == cc_custom)
+    {
+        for (id = 0; id < MAX_CC; id++)
+        {
+            if (p->cc_bank[id].valid &&
+                (memcmp(p->cc_bank[id].data, glyph, sizeof(glyph)) == 0))
+            {
+                p->cc_bank[id].last_used = ++p->cc_clock;
+                p->stats.bytes_saved += 11;
+                return id;
+            }
+        }
+    }
+
+    /* Not resident, take a free or else the least recently used slot.
+     * A slot the framebuffer or the screen still shows is left alone,
+     * redefining it would change those cells at once. */
+    id = -1;
+    for (i = 0; i < MAX_CC; i++)
+    {
+        if (mtxorb_glyph_shown(p, i))
+            continue;
+        if (!p->cc_bank[i].valid || (p->cc_mode != cc_custom))
+        {
+            id = i;
+            break;
+        }
+        if ((id == -1) || (p->cc_bank[i].last_used < p->cc_bank[id].last_used))
+            id = i;
+    }
+
+    if (id == -1)
+    {
+        p->stats.glyphs_missed++;
+        errno = ENOSPC;
+        return -1;
+    }
+
+    mtxorb_set_custom_char(p, id, (const char *)glyph);
+
+    return id;
+}
+
+void mtxorb_hbar(MTXORB *handle, int x, int y, int len, enum mtxorb_dir dir)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0, 0, 0, 0, 0};
+
+    p->api = MTXORB_API_HBAR;
+
+    if ((x < 0) || (x >= p->device.width) ||
+        (y < 0) || (y >= p->device.height) ||
+        (len < 0) || (len > 100))
+        return;
+
+    /* Initialize the bar, replacing custom characters
+     * currently present in memory bank 0.
+     */
+    if (p->cc_mode != cc_hbar)
+    {
+        out[1] = 'h';
+        mtxorb_emit(p, out, 2);
+
+        p->cc_mode = cc_hbar;
+    }
+
+    /* Place the bar */
+    out[1] = '\x7C';
+    out[2] = x + 1;
+    out[3] = y + 1;
+    out[4] = (dir == MTXORB_LEFT) ? 1 : 0;
+    out[5] = len;
+    mtxorb_emit(p, out, 6);
+
+    /* The module moves the cursor while placing it */
+    p->cur_x = -1;
+    p->cur_y = -1;
+}
+
+void mtxorb_vbar(MTXORB *handle, int x, int len, enum mtxorb_vbar_style style)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0, 0, 0};
+    enum mtxorb_cc_mode mode;
+
+    p->api = MTXORB_API_VBAR;
+
+    if ((x < 0) || (x >= p->device.width) ||
+        (len < 0) || (len > 32))
+        return;
+
+    /* Initialize the bar, replacing custom characters currently present
+     * in memory. */
+    mode = (style == MTXORB_WIDE) ? cc_vbar_wide : cc_vbar_narrow;
+    if (p->cc_mode != mode)
+    {
+        out[1] = (style == MTXORB_WIDE) ? 'v' : 'h';
+        mtxorb_emit(p, out, 2);
+
+        p->cc_mode = mode;
+    }
+
+    /* Place the bar */
+    out[1] = '=';
+    out[2] = x + 1;
+    out[3] = len;
+    mtxorb_emit(p, out, 4);
+
+    /* The module moves the cursor while placing it */
+    p->cur_x = -1;
+    p->cur_y = -1;
+}
+
+void mtxorb_bignum(MTXORB *handle, int x, int y, int digit, enum mtxorb_bignum_style style)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0, 0, 0, 0};
+    enum mtxorb_cc_mode mode;
+
+    p->api = MTXORB_API_BIGNUM;
+
+    if ((x < 0) || (x >= p->device.width) ||
+        (digit < 0) || (digit > 9))
+        return;
+
+    /* Initialize the bar, replacing all custom characters
+     * currently present. */
+    mode = (style == MTXORB_LARGE) ? cc_bignum_large : cc_bignum_medium;
+    if (p->cc_mode != mode)
+    {
+        out[1] = (style == MTXORB_LARGE) ? 'n' : 'm';
+        mtxorb_emit(p, out, 2);
+
+        p->cc_mode = mode;
+    }
+
+    /* Place the digit */
+    if (style == MTXORB_LARGE)
+    {
+        out[1] = '#';
+        out[2] = x + 1;
+        out[3] = digit;
+        mtxorb_emit(p, out, 4);
+    }
+    else
+    {
+        if ((y < 0) || (y >= p->device.height))
+            return;
+        /* Medium sized digit */
+        out[1] = 'o';
+        out[2] = y + 1;
+        out[3] = x + 1;
+        out[4] = digit;
+        mtxorb_emit(p, out, 5);
+    }
+
+    /* The module moves the cursor while placing it */
+    p->cur_x = -1;
+    p->cur_y = -1;
+}
+
+/* ----- Display functions ----- */
+
+void mtxorb_backlight_off(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+
+    p->api = MTXORB_API_BACKLIGHT_OFF;
+
+    mtxorb_emit(p, "\xFE"
+                   "F",
+                2);
+
+    /* A queued brightness must not be moved past this, and the next one
+     * has to be sent even if it is the same value */
+    p->pending[st_brightness] = -1;
+    p->state.brightness = -1;
+}
+
+void mtxorb_set_contrast(MTXORB *handle, int value)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 'P', 0};
+
+    p->api = MTXORB_API_SET_CONTRAST;
+
+    if ((value < 0) || (value > 255))
+        return;
+
+    if (p->state.contrast == value)
+    {
+        p->stats.bytes_saved += 3;
+        return;
+    }
+
+    if (HAS_CAP(p, CAP_CONTRAST))
+    {
+        out[2] = value;
+        mtxorb_emit_setting(p, st_contrast, out, 3);
+
+        p->state.contrast = value;
+    }
+}
+
+void mtxorb_set_brightness(MTXORB *handle, int value)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0, 0};
+
+    p->api = MTXORB_API_SET_BRIGHTNESS;
+
+    if ((value < 0) || (value > 255))
+        return;
+
+    if (HAS_CAP(p, CAP_BRIGHTNESS))
+    {
+        if (value > 3)
+            value = 3;
+        out[1] = 'Y';
+    }
+    else
+        out[1] = '\x99';
+
+    if (p->state.brightness == value)
+    {
+        p->stats.bytes_saved += 3;
+        return;
+    }
+
+    out[2] = value;
+    mtxorb_emit_setting(p, st_brightness, out, 3);
+
+    p->state.brightness = value;
+}
+
+void mtxorb_set_bg_color(MTXORB *handle, int r, int g, int b)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', '\x82', 0, 0, 0};
+    long color;
+
+    p->api = MTXORB_API_SET_BG_COLOR;
+
+    if (HAS_CAP(p, CAP_RGB))
+    {
+        out[2] = r & 0xFF;
+        out[3] = g & 0xFF;
+        out[4] = b & 0xFF;
+
+        color = ((long)out[2] << 16) | (out[3] << 8) | out[4];
+        if (p->state.bg_color == color)
+        {
+            p->stats.bytes_saved += 5;
+            return;
+        }
+
+        mtxorb_emit_setting(p, st_bg_color, out, 5);
+
+        p->state.bg_color = color;
+    }
+}
+
+/* ----- General Purpose Output functions ----- */
+
+void mtxorb_set_output(MTXORB *handle, enum mtxorb_gpo_flags flags)
+{
+    struct mtxorb_priv *p = handle;
+
+    /* Only one output on LCD/VFD displays, on if any flag is set */
+    if (!HAS_CAP(p, CAP_KEYPAD))
+        flags = (flags) ? MTXORB_GPO1 : 0;
+
+    mtxorb_set_output_mask(p, GPO_ALL, flags);
+}
+
+void mtxorb_set_output_mask(MTXORB *handle, enum mtxorb_gpo_flags mask, enum mtxorb_gpo_flags flags)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[GPO_COUNT * 3];
+    size_t n = 0;
+    int changed;
+    int i;
+
+    p->api = MTXORB_API_SET_OUTPUT;
+
+    if (HAS_CAP(p, CAP_KEYPAD))
+        mask &= GPO_ALL;
+    else
+        mask &= MTXORB_GPO1;
+
+    /* Outputs that differ from, or are missing in, the cached state */
+    changed = mask & (~p->state.gpo_known | (p->state.gpo ^ flags));
+    for (i = 0; i < GPO_COUNT; i++)
+    {
+        if ((mask & ~changed) & (1 << i))
+            p->stats.bytes_saved += HAS_CAP(p, CAP_KEYPAD) ? 3 : 2;
+    }
+    if (changed == 0)
+        return;
+
+    for (i = 0; i < GPO_COUNT; i++)
+    {
+        if (!(changed & (1 << i)))
+            continue;
+
+        out[n] = '\xFE';
+        out[n + 1] = (flags & (1 << i)) ? 'W' : 'V';
+        if (HAS_CAP(p, CAP_KEYPAD))
+        {
+            out[n + 2] = i + 1;
+            /* Queued per output so a newer value replaces it */
+            if (p->buffered)
+                mtxorb_emit_setting(p, st_gpo + i, out + n, 3);
+            else
+                n += 3;
+        }
+        else
+        {
+            if (p->buffered)
+                mtxorb_emit_setting(p, st_gpo, out + n, 2);
+            else
+                n += 2;
+        }
+    }
+
+    /* All changed outputs in a single write */
+    if (n > 0)
+        mtxorb_emit(p, out, n);
+
+    p->state.gpo = (p->state.gpo & ~changed) | (flags & changed);
+    p->state.gpo_known |= changed;
+}
+
+/* ----- Keypad functions ----- */
+
+void mtxorb_keypad_backlight_off(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+
+    p->api = MTXORB_API_KEYPAD_BACKLIGHT_OFF;
+
+    if (HAS_CAP(p, CAP_RGB))
+    {
+        mtxorb_emit(p, "\xFE"
+                       "\x9B",
+                    2);
+
+        /* A queued brightness must not be moved past this, and the next
+         * one has to be sent even if it is the same value */
+        p->pending[st_keypad_brightness] = -1;
+        p->state.keypad_brightness = -1;
+    }
+}
+
+void mtxorb_set_keypad_brightness(MTXORB *handle, int value)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', '\x9C', 0};
+
+    p->api = MTXORB_API_SET_KEYPAD_BRIGHTNESS;
+
+    if (HAS_CAP(p, CAP_RGB))
+    {
+        if ((value < 0) || (value > 255))
+            return;
+
+        if (p->state.keypad_brightness == value)
+        {
+            p->stats.bytes_saved += 3;
+            return;
+        }
+
+        out[2] = value;
+        mtxorb_emit_setting(p, st_keypad_brightness, out, 3);
+
+        p->state.keypad_brightness = value;
+    }
+}
+
+void mtxorb_set_key_auto_repeat(MTXORB *handle, enum mtxorb_onoff on)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', '\x7E', 0};
+
+    p->api = MTXORB_API_SET_KEY_AUTO_REPEAT;
+
+    if (HAS_CAP(p, CAP_KEYPAD))
+    {
+        out[2] = (on == MTXORB_ON) ? 1 : 0;
+        if (p->state.key_auto_repeat == out[2])
+        {
+            p->stats.bytes_saved += 3;
+            return;
+        }
+
+        mtxorb_emit_setting(p, st_key_auto_repeat, out, 3);
+
+        p->state.key_auto_repeat = out[2];
+    }
+}
+
+void mtxorb_set_key_debounce_time(MTXORB *handle, int value)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 'U', 0};
+
+    p->api = MTXORB_API_SET_KEY_DEBOUNCE_TIME;
+
+    if ((value < 0) || (value > 255))
+        return;
+
+    if (HAS_CAP(p, CAP_KEYPAD))
+    {
+        if (p->state.key_debounce == value)
+        {
+            p->stats.bytes_saved += 3;
+            return;
+        }
+
+        out[2] = value;
+        mtxorb_emit_setting(p, st_key_debounce, out, 3);
+
+        p->state.key_debounce = value;
+    }
+}
+
+/* ----- Query functions ----- */
+
+int mtxorb_query(MTXORB *handle, int op, unsigned char *reply, size_t n, int timeout)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0};
+    unsigned char keys[64];
+    struct timespec deadline, settle;
+    size_t got, k;
+    int keypad = HAS_CAP(p, CAP_KEYPAD);
+
+    p->api = MTXORB_API_QUERY;
+
+    if ((op < 0) || (op > 255) || ((reply == NULL) && (n > 0)) || (timeout < 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtxorb_deadline(&deadline, timeout);
+
+    LOCK(p);
+
+    /* Everything queued goes out first, the reply is read right here */
+    mtxorb_flush_all(p);
+    mtxorb_sync(p, -1);
+
+    if (keypad || mtxorb_late_reply(p))
+    {
+        /* Hold off key presses. What arrives until the keys in flight are
+         * through are key presses as well, or the rest of the reply to an
+         * earlier query that timed out. */
+        if (keypad)
+        {
+            out[1] = 'O';
+            mtxorb_send_now(p, out, 2);
+        }
+
+        mtxorb_deadline(&settle, QUERY_SETTLE);
+        if (mtxorb_ms_left(&settle) > mtxorb_ms_left(&deadline))
+            settle = deadline;
+        while ((k = mtxorb_read_until(p, keys, sizeof(keys), &settle)) > 0)
+            mtxorb_queue_keys(p, keys, k);
+    }
+
+    out[1] = op;
+    mtxorb_send_now(p, out, 2);
+    got = mtxorb_read_until(p, reply, n, &deadline);
+
+    /* The rest of the reply may still come, it must not be taken for key
+     * presses, see mtxorb_queue_keys() */
+    if (got < n)
+    {
+        p->late_reply = n - got;
+        p->late_until = mtxorb_now_ms() + QUERY_LATE;
+    }
+
+    if (keypad)
+    {
+        out[1] = 'A';
+        mtxorb_send_now(p, out, 2);
+    }
+
+    UNLOCK(p);
+
+    if (got < n)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return (int)n;
+}
+
+int mtxorb_probe(MTXORB *handle, struct mtxorb_module *module, int timeout)
+{
+    struct mtxorb_priv *p = handle;
+    struct timespec deadline;
+    unsigned char type, version;
+    int i;
+
+    mtxorb_deadline(&deadline, timeout);
+    if ((mtxorb_query(p, '7', &type, 1, timeout) == -1) ||
+        (mtxorb_query(p, '6', &version, 1, mtxorb_ms_left(&deadline)) == -1))
+        return -1;
+
+    module->type = type;
+    module->version = version;
+    module->name = NULL;
+    memset(&module->info, 0, sizeof(module->info));
+
+    for (i = 0; i < MODEL_COUNT; i++)
+    {
+        if (models[i].type == type)
+        {
+            module->name = models[i].name;
+            module->info = models[i].info;
+            break;
+        }
+    }
+
+    if (module->name == NULL)
+    {
+        errno = ENODEV;
+        return -1;
+    }
+
+    LOCK(p);
+    p->device = module->info;
+    p->caps = mtxorb_device_caps(p->device.type);
+    memset(p->shadow, SHADOW_UNKNOWN, sizeof(p->shadow));
+    p->cur_x = -1;
+    p->cur_y = -1;
+    UNLOCK(p);
+
+    return 0;
+}
+
+/* ----- Framebuffer functions ----- */
+
+void mtxorb_fb_clear(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+
+    int i;
+
+    memset(p->fb, ' ', sizeof(p->fb));
+
+    /* Widgets draw themselves again */
+    for (i = 0; i < WIDGET_MAX; i++)
+        p->widgets[i].dirty = 1;
+}
+
+void mtxorb_fb_putc(MTXORB *handle, int x, int y, char c)
+{
+    struct mtxorb_priv *p = handle;
+
+    if ((x < 0) || (x >= p->device.width) ||
+        (y < 0) || (y >= p->device.height))
+        return;
+
+    p->fb[y][x] = (c == '\xFE') ? ' ' : c;
+}
+
+void mtxorb_fb_put(MTXORB *handle, int x, int y, const char *s)
+{
+    struct mtxorb_priv *p = handle;
+
+    if ((s == NULL) ||
+        (x < 0) || (x >= p->device.width) ||
+        (y < 0) || (y >= p->device.height))
+        return;
+
+    /* Clip at the end of the row */
+    for (; (*s != '\0') && (x < p->device.width); ++s, ++x)
+        p->fb[y][x] = (*s == '\xFE') ? ' ' : *s;
+}
+
+void mtxorb_fb_hbar(MTXORB *handle, int x, int y, int width, int len, enum mtxorb_dir dir)
+{
+    struct mtxorb_priv *p = handle;
+    int cw = p->device.cellwidth;
+    int full, part, i, cx;
+
+    if ((y < 0) || (y >= p->device.height) || (width <= 0) || (len < 0))
+        return;
+
+    if (len > width * cw)
+        len = width * cw;
+
+    /* Only occupy the slots that are needed */
+    full = (len >= cw) ? mtxorb_bar_glyph(p, cw, cw, dir) : ' ';
+    part = mtxorb_bar_glyph(p, len % cw, cw, dir);
+
+    /* Cells are counted from x in the direction of the bar */
+    for (i = 0; i < width; i++)
+    {
+        cx = (dir == MTXORB_LEFT) ? x - i : x + i;
+        if (i < len / cw)
+            mtxorb_fb_putc(p, cx, y, full);
+        else if ((i == len / cw) && (len % cw))
+            mtxorb_fb_putc(p, cx, y, part);
+        else
+            mtxorb_fb_putc(p, cx, y, ' ');
+    }
+}
+
+void mtxorb_fb_vbar(MTXORB *handle, int x, int y, int height, int len)
+{
+    struct mtxorb_priv *p = handle;
+    int ch = p->device.cellheight;
+    int full, part, i;
+
+    if ((x < 0) || (x >= p->device.width) || (height <= 0) || (len < 0))
+        return;
+
+    if (len > height * ch)
+        len = height * ch;
+
+    full = (len >= ch) ? mtxorb_bar_glyph(p, ch, ch, -1) : ' ';
+    part = mtxorb_bar_glyph(p, len % ch, ch, -1);
+
+    /* Grows upwards from the bottom cell at y */
+    for (i = 0; i < height; i++)
+    {
+        if (i < len / ch)
+            mtxorb_fb_putc(p, x, y - i, full);
+        else if ((i == len / ch) && (len % ch))
+            mtxorb_fb_putc(p, x, y - i, part);
+        else
+            mtxorb_fb_putc(p, x, y - i, ' ');
+    }
+}
+
+void mtxorb_fb_bignum(MTXORB *handle, int x, int y, int digit)
+{
+    struct mtxorb_priv *p = handle;
+    int ids[] = {-1, -1, -1, -1, -1};
+
+    if ((digit < 0) || (digit > 9))
+        return;
+
+    mtxorb_big_char(p, x, y, '0' + digit, ids);
+}
+
+int mtxorb_fb_bigstr(MTXORB *handle, int x, int y, const char *s)
+{
+    struct mtxorb_priv *p = handle;
+    int ids[] = {-1, -1, -1, -1, -1};
+    int n = 0;
+
+    if (s == NULL)
+        return 0;
+
+    /* Each glyph is looked up once per string */
+    for (; *s != '\0'; ++s)
+        n += mtxorb_big_char(p, x + n, y, *s, ids);
+
+    return n;
+}
+
+void mtxorb_fb_icon(MTXORB *handle, int x, int y, enum mtxorb_icon icon)
+{
+    struct mtxorb_priv *p = handle;
+    int id;
+
+    if (((int)icon < 0) || (icon >= sizeof(icons) / sizeof(icons[0])))
+        return;
+
+    /* Blank rather than the old content when no slot is free */
+    id = mtxorb_load_glyph(p, (const char *)icons[icon]);
+    mtxorb_fb_putc(p, x, y, (id < 0) ? ' ' : id);
+}
+
+void mtxorb_fb_invalidate(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+
+    memset(p->shadow, SHADOW_UNKNOWN, sizeof(p->shadow));
+}
+
+int mtxorb_fb_present(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[FRAME_MAX];
+    size_t n, full;
+
+    p->api = MTXORB_API_FB_PRESENT;
+
+    mtxorb_widgets_update(p, mtxorb_now_ms());
+
+    /* The frame is planned from where the cursor is, nothing may come
+     * in between */
+    LOCK(p);
+    mtxorb_check_cursor(p);
+
+    full = mtxorb_fb_repaint_cost(p);
+    n = mtxorb_fb_plan(p, out, 0, FRAME_MAX, 0, &p->cur_x, &p->cur_y);
+    if (n > 0)
+        mtxorb_emit(p, out, n);
+
+    if (full > n)
+        p->stats.bytes_saved += full - n;
+
+    if (p->buffered)
+        mtxorb_send_queue(p);
+
+    UNLOCK(p);
+
+    return (int)n;
+}
+
+int mtxorb_fb_cost(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+    int x = p->cur_x, y = p->cur_y;
+
+    return (int)mtxorb_fb_plan(p, NULL, 0, FRAME_MAX, 0, &x, &y);
+}
+
+void mtxorb_fb_set_rate(MTXORB *handle, int fps)
+{
+    struct mtxorb_priv *p = handle;
+
+    p->fps = (fps > 0) ? fps : 0;
+    mtxorb_update_rate(p);
+}
+
+
+void mtxorb_fb_set_priority(MTXORB *handle, int x, int y, int width, int height, enum mtxorb_onoff on)
+{
+    struct mtxorb_priv *p = handle;
+    int cx, cy;
+
+    for (cy = y; cy < y + height; cy++)
+    {
+        for (cx = x; cx < x + width; cx++)
+        {
+            if ((cx >= 0) && (cx < p->device.width) &&
+                (cy >= 0) && (cy < p->device.height))
+                p->prio[cy][cx] = (on == MTXORB_ON);
+        }
+    }
+}
+
+int mtxorb_fb_tick(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[FRAME_MAX];
+    unsigned long now = mtxorb_now_ms();
+    size_t n, full;
+
+    p->api = MTXORB_API_FB_TICK;
+
+    if ((p->frame_ms > 0) && ((long)(now - p->next_frame) < 0))
+        return 0;
+
+    mtxorb_widgets_update(p, now);
+
+    LOCK(p);
+    mtxorb_check_cursor(p);
+
+    /* High-priority cells go first, the rest fills up the budget */
+    full = mtxorb_fb_repaint_cost(p);
+    n = mtxorb_fb_plan(p, out, 0, p->frame_budget, 1, &p->cur_x, &p->cur_y);
+    n = mtxorb_fb_plan(p, out, n, p->frame_budget, 0, &p->cur_x, &p->cur_y);
+    if (n > 0)
+    {
+        /* Rows left dirty are not done yet */
+        full -= mtxorb_fb_repaint_cost(p);
+        if (full > n)
+            p->stats.bytes_saved += full - n;
+
+        mtxorb_emit(p, out, n);
+        if (p->buffered)
+            mtxorb_send_queue(p);
+
+        p->next_frame = now + p->frame_ms;
+    }
+
+    UNLOCK(p);
+
+    return (int)n;
+}
+
+int mtxorb_fb_next_tick(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned long now = mtxorb_now_ms();
+    long left;
+
+    /* Nothing to send, wake up for the next marquee step */
+    if ((mtxorb_fb_cost(p) == 0) && !mtxorb_widgets_dirty(p))
+        return (int)mtxorb_widgets_next_step(p, now);
+
+    left = (long)(p->next_frame - now);
+    if ((p->frame_ms == 0) || (left < 0))
+        return 0;
+
+    return (int)left;
+}
+
+/* ----- Widget functions ----- */
+
+int mtxorb_widget_label(MTXORB *handle, int x, int y, int width, enum mtxorb_align align)
+{
+    struct mtxorb_priv *p = handle;
+    int id;
+
+    id = mtxorb_widget_new(p, wd_label, x, y, width);
+    if (id >= 0)
+        p->widgets[id].align = align;
+
+    return id;
+}
+
+int mtxorb_widget_marquee(MTXORB *handle, int x, int y, int width, int step_ms)
+{
+    struct mtxorb_priv *p = handle;
+    int id;
+
+    if (step_ms <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    id = mtxorb_widget_new(p, wd_marquee, x, y, width);
+    if (id >= 0)
+        p->widgets[id].step_ms = step_ms;
+
+    return id;
+}
+
+int mtxorb_widget_number(MTXORB *handle, int x, int y, int width, int decimals)
+{
+    struct mtxorb_priv *p = handle;
+    int id;
+
+    if ((decimals < 0) || (decimals > 9))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    id = mtxorb_widget_new(p, wd_number, x, y, width);
+    if (id >= 0)
+        p->widgets[id].decimals = decimals;
+
+    return id;
+}
+
+void mtxorb_widget_set_text(MTXORB *handle, int id, const char *s)
+{
+    struct mtxorb_priv *p = handle;
+    struct mtxorb_widget *w;
+    size_t len;
+
+    if ((id < 0) || (id >= WIDGET_MAX) || (p->widgets[id].type == wd_free) || (s == NULL))
+        return;
+
+    w = &p->widgets[id];
+    len = strlen(s);
+    if (len > WIDGET_TEXT_MAX)
+        len = WIDGET_TEXT_MAX;
+
+    /* Same text, nothing to draw */
+    if ((len == w->len) && (memcmp(w->text, s, len) == 0))
+        return;
+
+    memcpy(w->text, s, len);
+    w->text[len] = '\0';
+    w->len = len;
+    w->dirty = 1;
+
+    /* A new text scrolls in from the start */
+    w->offset = 0;
+    w->next_step = mtxorb_now_ms() + w->step_ms;
+}
+
+void mtxorb_widget_set_value(MTXORB *handle, int id, long value)
+{
+    struct mtxorb_priv *p = handle;
+    char s[32];
+    unsigned long a, scale = 1;
+    int i, n;
+
+    if ((id < 0) || (id >= WIDGET_MAX) || (p->widgets[id].type == wd_free))
+        return;
+
+    for (i = 0; i < p->widgets[id].decimals; i++)
+        scale *= 10;
+
+    /* Fixed point, without the overflow of negating LONG_MIN */
+    a = (value < 0) ? 0UL - (unsigned long)value : (unsigned long)value;
+    n = sprintf(s, "%s%lu", (value < 0) ? "-" : "", a / scale);
+
+    /* The fraction as 9 digits, cut to the number of decimals */
+    if (p->widgets[id].decimals > 0)
+    {
+        sprintf(s + n, ".%09lu", (a % scale) * (1000000000UL / scale));
+        s[n + 1 + p->widgets[id].decimals] = '\0';
+    }
+
+    mtxorb_widget_set_text(p, id, s);
+}
+
+void mtxorb_widget_remove(MTXORB *handle, int id)
+{
+    struct mtxorb_priv *p = handle;
+    struct mtxorb_widget *w;
+    int i;
+
+    if ((id < 0) || (id >= WIDGET_MAX) || (p->widgets[id].type == wd_free))
+        return;
+
+    w = &p->widgets[id];
+    for (i = 0; i < w->width; i++)
+        mtxorb_fb_putc(p, w->x + i, w->y, ' ');
+
+    w->type = wd_free;
+}
+
+/* ----- Batch functions ----- */
+
+void mtxorb_batch_init(struct mtxorb_batch *b)
+{
+    b->len = 0;
+    b->overflow = 0;
+}
+
+void mtxorb_batch_gotoxy(struct mtxorb_batch *b, int x, int y)
+{
+    unsigned char out[4];
+
+    /* Out of range becomes 0, which the display ignores, as mtxorb_gotoxy() */
+    out[0] = '\xFE';
+    out[1] = 'G';
+    out[2] = ((x >= 0) && (x < 255)) ? x + 1 : 0;
+    out[3] = ((y >= 0) && (y < 255)) ? y + 1 : 0;
+
+    mtxorb_batch_add(b, out, 4);
+}
+
+void mtxorb_batch_putc(struct mtxorb_batch *b, int c)
+{
+    unsigned char out = (unsigned char)c;
+
+    if (out == 0xFE)
+        out = ' ';
+
+    mtxorb_batch_add(b, &out, 1);
+}
+
+void mtxorb_batch_puts(struct mtxorb_batch *b, const char *s)
+{
+    size_t n = strlen(s);
+    unsigned char *c, *end;
+
+    if (b->overflow || (b->len + n > MTXORB_BATCH_SIZE))
+    {
+        b->overflow = 1;
+        return;
+    }
+
+    memcpy(b->buf + b->len, s, n);
+    end = b->buf + b->len + n;
+    for (c = b->buf + b->len; c < end; c++)
+    {
+        if (*c == 0xFE)
+            *c = ' ';
+    }
+    b->len += n;
+}
+
+void mtxorb_batch_write(struct mtxorb_batch *b, const void *buf, size_t n)
+{
+    mtxorb_batch_add(b, buf, n);
+}
+
+int mtxorb_batch_commit(MTXORB *handle, struct mtxorb_batch *b)
+{
+    struct mtxorb_priv *p = handle;
+    struct iovec iov;
+    int overflow = b->overflow;
+
+    if (!overflow && (b->len > 0))
+    {
+        iov.iov_base = b->buf;
+        iov.iov_len = b->len;
+
+        /* p->api belongs to the owner thread */
+        LOCK(p);
+        mtxorb_emit_as(p, MTXORB_API_BATCH, &iov, 1);
+        if (p->buffered)
+            mtxorb_send_queue(p);
+        p->cursor_lost = 1;
+        UNLOCK(p);
+    }
+
+    mtxorb_batch_init(b);
+
+    if (overflow)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    return 0;
+}
+
+void mtxorb_lock(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+
+    LOCK(p);
+}
+
+void mtxorb_unlock(MTXORB *handle)
+{
+    struct mtxorb_priv *p = handle;
+
+    UNLOCK(p);
+}
+
+/* ----- Multi-display functions ----- */
+
+#ifndef MTXORB_NO_MALLOC
+MTXORB_GROUP *mtxorb_group_new(void)
+{
+    struct mtxorb_group *g;
+
+    g = malloc(sizeof(struct mtxorb_group));
+    if (g == NULL)
+        return NULL;
+
+    if ((g->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        free(g);
+        return NULL;
+    }
+
+    g->count = 0;
+
+    return g;
+}
+
+void mtxorb_group_free(MTXORB_GROUP *group)
+{
+    struct mtxorb_group *g = group;
+
+    if (g == NULL)
+        return;
+
+    while (g->count > 0)
+        mtxorb_group_remove(g, g->members[0]);
+
+    close(g->epfd);
+    free(g);
+}
+#endif /* MTXORB_NO_MALLOC */
+
+int mtxorb_group_add(MTXORB_GROUP *group, MTXORB *handle)
+{
+    struct mtxorb_group *g = group;
+    struct mtxorb_priv *p = handle;
+    struct epoll_event ev;
+
+    if (p->grouped || p->async)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (g->count == GROUP_MAX)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(g->epfd, EPOLL_CTL_ADD, p->fd, &ev) == -1)
+        return -1;
+
+    /* Writes must never block the other displays */
+    LOCK(p);
+    p->group_nonblock = p->nonblock;
+    p->group_buffered = p->buffered;
+    p->group_high_water = p->high_water;
+    p->fd_flags = fcntl(p->fd, F_GETFL);
+    fcntl(p->fd, F_SETFL, p->fd_flags | O_NONBLOCK);
+    p->nonblock = 1;
+
+    if (!p->buffered)
+        mtxorb_set_buffered(p, MTXORB_ON, 0);
+    p->grouped = 1;
+    UNLOCK(p);
+
+    g->members[g->count] = p;
+    g->events[g->count] = EPOLLIN;
+    g->count++;
+
+    return 0;
+}
+
+void mtxorb_group_remove(MTXORB_GROUP *group, MTXORB *handle)
+{
+    struct mtxorb_group *g = group;
+    struct mtxorb_priv *p = handle;
+    int i;
+
+    for (i = 0; i < g->count; i++)
+    {
+        if (g->members[i] == p)
+            break;
+    }
+    if (i == g->count)
+        return;
+
+    epoll_ctl(g->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+
+    g->count--;
+    g->members[i] = g->members[g->count];
+    g->events[i] = g->events[g->count];
+
+    /* Back to the output mode from before, sending what is left */
+    LOCK(p);
+    p->grouped = 0;
+    p->nonblock = p->group_nonblock;
+    fcntl(p->fd, F_SETFL, p->fd_flags);
+    mtxorb_flush_all(p);
+    if (!p->group_buffered)
+        p->buffered = 0;
+    p->high_water = p->group_high_water;
+    UNLOCK(p);
+}
+
+int mtxorb_group_get_fd(MTXORB_GROUP *group)
+{
+    struct mtxorb_group *g = group;
+
+    return g->epfd;
+}
+
+void mtxorb_group_present(MTXORB_GROUP *group)
+{
+    struct mtxorb_group *g = group;
+    int i;
+
+    for (i = 0; i < g->count; i++)
+        mtxorb_fb_present(g->members[i]);
+}
+
+int mtxorb_group_run(MTXORB_GROUP *group, int timeout)
+{
+    struct mtxorb_group *g = group;
+    struct epoll_event ev[GROUP_MAX];
+    struct mtxorb_priv *p;
+    unsigned int want, held = 0;
+    long ms;
+    int i, n;
+
+    /* Only ask for POLLOUT where output is waiting. A display paced after a
+     * slow command waits for the end of its gap instead. */
+    for (i = 0; i < g->count; i++)
+    {
+        p = g->members[i];
+        want = EPOLLIN;
+        if ((p->outlen > p->outoff) || (p->resume_len > 0))
+        {
+            ms = (mtxorb_pace_left(p) + 999) / 1000;
+            if (ms == 0)
+                want |= EPOLLOUT;
+            else
+            {
+                held |= 1U << i;
+                if ((timeout < 0) || (ms < timeout))
+                    timeout = (int)ms;
+            }
+        }
+
+        if (want != g->events[i])
+        {
+            ev[0].events = want;
+            ev[0].data.ptr = p;
+            epoll_ctl(g->epfd, EPOLL_CTL_MOD, p->fd, &ev[0]);
+            g->events[i] = want;
+        }
+    }
+
+    n = epoll_wait(g->epfd, ev, GROUP_MAX, timeout);
+    if (n == -1)
+        return (errno == EINTR) ? 0 : -1;
+
+    for (i = 0; i < n; i++)
+    {
+        p = ev[i].data.ptr;
+
+        if (ev[i].events & (EPOLLERR | EPOLLHUP))
+            STORE_SEQ(p->hangup, 1);
+        if (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            mtxorb_drain(p);
+        if (ev[i].events & EPOLLIN)
+            mtxorb_process_input(p);
+    }
+
+    for (i = 0; i < g->count; i++)
+    {
+        p = g->members[i];
+        if ((held & (1U << i)) && (mtxorb_pace_left(p) == 0))
+        {
+            mtxorb_drain(p);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* ----- Fast path functions ----- */
+
+unsigned char *mtxorb_reserve(MTXORB *handle, size_t n)
+{
+    struct mtxorb_priv *p = handle;
+
+    if (n > OUTBUF_SIZE)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Held until mtxorb_commit() */
+    LOCK(p);
+
+    /* Unbuffered, the empty queue serves as scratch space */
+    if (p->buffered && (p->outlen + n > OUTBUF_SIZE))
+    {
+        mtxorb_send_queue(p);
+        if (p->nonblock && !p->async)
+            mtxorb_make_room(p, n);
+    }
+
+    return p->outbuf + p->outlen;
+}
+
+void mtxorb_commit(MTXORB *handle, size_t n)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char *buf = p->outbuf + p->outlen;
+
+    p->api = MTXORB_API_COMMIT;
+
+    if (n > 0)
+    {
+        mtxorb_count_commands(p, buf, n);
+        if (p->trace != NULL)
+            mtxorb_trace_record(p, p->api, buf, n);
+        mtxorb_forget_outputs(p, buf, n);
+
+        if (p->buffered)
+        {
+            p->outlen += n;
+            if (p->outlen >= p->high_water)
+                mtxorb_send_queue(p);
+        }
+        else
+            mtxorb_xmit(p, buf, n);
+
+        /* The encoders don't track the cursor */
+        p->cur_x = -1;
+        p->cur_y = -1;
+    }
+
+    UNLOCK(p);
+}
+
+/* ------ Internal functions ----- */
+
+/* Batches from other threads moved the cursor */
+static void mtxorb_check_cursor(struct mtxorb_priv *p)
+{
+    if (p->cursor_lost)
+    {
+        p->cur_x = -1;
+        p->cur_y = -1;
+        p->cursor_lost = 0;
+    }
+}
+
+/* Append n bytes to a batch, or mark it overflowed */
+static void mtxorb_batch_add(struct mtxorb_batch *b, const void *buf, size_t n)
+{
+    if (b->overflow || (b->len + n > MTXORB_BATCH_SIZE))
+    {
+        b->overflow = 1;
+        return;
+    }
+
+    memcpy(b->buf + b->len, buf, n);
+    b->len += n;
+}
+
+/* Move the tracked cursor as the display does after writing n characters
+ * from (x, y). Position becomes unknown (-1) when it can't be predicted. */
+static void mtxorb_cursor_advance(struct mtxorb_priv *p, int *x, int *y, int n)
+{
+    int width = p->device.width;
+    int pos;
+
+    if ((*x < 0) || (*y < 0))
+        return;
+
+    if (*x + n < width)
+    {
+        *x += n;
+        return;
+    }
+
+    /* Ran off the end of the row. With line wrap on the cursor continues on
+     * the next row, except past the last cell where it depends on scroll. */
+    if (p->state.line_wrap == 1)
+    {
+        pos = *y * width + *x + n;
+        if (pos < width * p->device.height)
+        {
+            *x = pos % width;
+            *y = pos / width;
+            return;
+        }
+    }
+
+    *x = -1;
+    *y = -1;
+}
+
+/* Build the byte stream that brings the display from 'shadow' to 'fb',
+ * appending to 'out' at offset n, starting with the cursor at
+ * (*cur_x, *cur_y). For each dirty run the cheapest way to get there is
+ * picked: the cursor is already there, rewrite up to 3 cells in between
+ * (possibly across a line wrap) or an absolute FE G goto of 4 bytes.
+ * Stops when 'budget' bytes are reached, cells that didn't fit stay dirty.
+ * With 'prio_only' set only high-priority cells are sent.
+ * When 'out' is NULL only the bytes are counted, otherwise the shadow is
+ * updated. Leaves the predicted cursor position behind and returns the new
+ * number of bytes. */
+static size_t mtxorb_fb_plan(struct mtxorb_priv *p, unsigned char *out, size_t n, size_t budget,
+                             int prio_only, int *cur_x, int *cur_y)
+{
+    int width = p->device.width;
+    int height = p->device.height;
+    int x, y, start, gap, move, len, i, gx, gy;
+    int last = 0;
+
+#define DIRTY(x, y) ((p->fb[y][x] != p->shadow[y][x]) && (!prio_only || p->prio[y][x]))
+
+    for (y = 0; (y < height) && !last; y++)
+    {
+        x = 0;
+        while ((x < width) && !last)
+        {
+            /* Skip cells that are already on the display */
+            if (!DIRTY(x, y))
+            {
+                x++;
+                continue;
+            }
+
+            /* Collect the run of changed cells */
+            start = x;
+            while ((x < width) && DIRTY(x, y))
+                x++;
+
+            /* Number of cells between the cursor and the run */
+            gap = -1;
+            if ((*cur_x >= 0) && ((*cur_y == y) || (p->state.line_wrap == 1)))
+                gap = (y * width + start) - (*cur_y * width + *cur_x);
+
+            /* Rewriting a few cells in between beats a goto */
+            if ((gap > 0) && (gap < 4))
+                move = gap;
+            else
+                move = (gap == 0) ? 0 : 4;
+
+            /* Send what fits and leave the rest for the next frame */
+            len = x - start;
+            if (n + move + len > budget)
+            {
+                if (n + move >= budget)
+                    return n;
+                len = budget - n - move;
+                last = 1;
+            }
+
+            if (move == 4)
+            {
+                if (out != NULL)
+                {
+                    out[n] = '\xFE';
+                    out[n + 1] = 'G';
+                    out[n + 2] = start + 1;
+                    out[n + 3] = y + 1;
+                }
+                n += 4;
+            }
+            else
+            {
+                for (i = 0; i < move; i++)
+                {
+                    gx = (*cur_x + i) % width;
+                    gy = *cur_y + (*cur_x + i) / width;
+                    if (out != NULL)
+                    {
+                        out[n] = p->fb[gy][gx];
+                        p->shadow[gy][gx] = p->fb[gy][gx];
+                    }
+                    n++;
+                }
+            }
+
+            if (out != NULL)
+            {
+                memcpy(out + n, &p->fb[y][start], len);
+                memcpy(&p->shadow[y][start], &p->fb[y][start], len);
+            }
+            n += len;
+
+            *cur_x = start;
+            *cur_y = y;
+            mtxorb_cursor_advance(p, cur_x, cur_y, len);
+        }
+    }
+
+#undef DIRTY
+
+    return n;
+}
+
+/* All output goes through here. In buffered mode the bytes are queued,
+ * otherwise they are written immediately. A command is never split
+ * between two writes. */
+static void mtxorb_emit(struct mtxorb_priv *p, const void *buf, size_t n)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = n;
+
+    mtxorb_emitv(p, &iov, 1);
+}
+
+/* Emit output gathered from several segments. Unbuffered, they are handed
+ * to the port together without being copied. */
+static void mtxorb_emitv(struct mtxorb_priv *p, const struct iovec *iov, int cnt)
+{
+    mtxorb_emit_as(p, p->api, iov, cnt);
+}
+
+/* Emit output on behalf of public function 'api', for the counters and the
+ * trace. Batches from other threads don't touch p->api. */
+static void mtxorb_emit_as(struct mtxorb_priv *p, int api, const struct iovec *iov, int cnt)
+{
+    size_t n = 0;
+    int i;
+
+    LOCK(p);
+
+    for (i = 0; i < cnt; i++)
+    {
+        mtxorb_count_commands(p, iov[i].iov_base, iov[i].iov_len);
+        if (p->trace != NULL)
+            mtxorb_trace_record(p, api, iov[i].iov_base, iov[i].iov_len);
+        n += iov[i].iov_len;
+    }
+
+    if (p->buffered)
+        mtxorb_queuev(p, iov, cnt, n);
+    else
+        mtxorb_xmitv(p, iov, cnt);
+
+    UNLOCK(p);
+}
+
+/* Append n bytes to the output queue */
+static void mtxorb_queuev(struct mtxorb_priv *p, const struct iovec *iov, int cnt, size_t n)
+{
+    int i;
+
+    if (p->outlen + n > OUTBUF_SIZE)
+    {
+        mtxorb_send_queue(p);
+        if (p->nonblock && !p->async)
+            mtxorb_make_room(p, n);
+    }
+
+    /* Too big to queue, send it as is */
+    if (n > OUTBUF_SIZE)
+    {
+        mtxorb_xmitv(p, iov, cnt);
+        return;
+    }
+
+    for (i = 0; i < cnt; i++)
+    {
+        memcpy(p->outbuf + p->outlen, iov[i].iov_base, iov[i].iov_len);
+        p->outlen += iov[i].iov_len;
+    }
+
+    if (p->outlen >= p->high_water)
+        mtxorb_send_queue(p);
+}
+
+/* Emit the command of an idempotent setting. In buffered mode a command
+ * of the same setting that is still queued is overwritten in place, so only
+ * the newest value is sent. These commands don't affect text, so moving
+ * the value ahead of text queued after the old command is harmless. */
+static void mtxorb_emit_setting(struct mtxorb_priv *p, enum mtxorb_setting st, const void *buf, size_t n)
+{
+    int off;
+
+    LOCK(p);
+
+    off = p->pending[st];
+    if (!p->buffered)
+        mtxorb_emit(p, buf, n);
+    else if (off != -1)
+    {
+        if (p->trace != NULL)
+            mtxorb_trace_record(p, p->api, buf, n);
+        memcpy(p->outbuf + off, buf, n);
+        p->stats.bytes_saved += n;
+    }
+    else
+    {
+        if (p->outlen + n > OUTBUF_SIZE)
+            mtxorb_send_queue(p);
+
+        off = p->outlen;
+        mtxorb_emit(p, buf, n);
+
+        /* Remember it, unless the high-water mark sent it already */
+        if (p->outlen == off + n)
+            p->pending[st] = off;
+    }
+
+    UNLOCK(p);
+}
+
+/* Get the character code of a bar cell filled 'fill' of 'size' pixels,
+ * from the left or right (dir) or from the bottom (dir = -1). A full cell
+ * is the same glyph for all bars. Returns a space if nothing is filled.
+ * Without a free custom character, a cell filled at least halfway is the
+ * full block of the character ROM and any other a space. */
+static int mtxorb_bar_glyph(struct mtxorb_priv *p, int fill, int size, int dir)
+{
+    char glyph[MAX_CELLHEIGHT];
+    int cw = p->device.cellwidth;
+    int ch = p->device.cellheight;
+    int row, bits;
+    int id;
+
+    if (fill <= 0)
+        return ' ';
+
+    if (fill >= size)
+    {
+        memset(glyph, (1 << cw) - 1, sizeof(glyph));
+    }
+    else if (dir == -1)
+    {
+        for (row = 0; row < MAX_CELLHEIGHT; row++)
+            glyph[row] = (row >= ch - fill) ? (1 << cw) - 1 : 0;
+    }
+    else
+    {
+        /* Bit (cellwidth - 1) is the leftmost pixel */
+        bits = (1 << fill) - 1;
+        if (dir == MTXORB_RIGHT)
+            bits <<= cw - fill;
+        memset(glyph, bits, sizeof(glyph));
+    }
+
+    id = mtxorb_load_glyph(p, glyph);
+    if (id < 0)
+        return (fill * 2 >= size) ? FULL_BLOCK : ' ';
+
+    return id;
+}
+
+static int mtxorb_widget_new(struct mtxorb_priv *p, enum mtxorb_widget_type type, int x, int y, int width)
+{
+    struct mtxorb_widget *w;
+    int id;
+
+    if ((x < 0) || (y < 0) || (y >= p->device.height) ||
+        (width <= 0) || (x + width > p->device.width))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (id = 0; (id < WIDGET_MAX) && (p->widgets[id].type != wd_free); id++)
+        ;
+    if (id == WIDGET_MAX)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    w = &p->widgets[id];
+    w->type = type;
+    w->x = x;
+    w->y = y;
+    w->width = width;
+    w->align = MTXORB_ALIGN_LEFT;
+    w->decimals = 0;
+    w->len = 0;
+    w->text[0] = '\0';
+    w->offset = 0;
+    w->step_ms = 0;
+    w->next_step = 0;
+    w->dirty = 1;
+
+    return id;
+}
+
+/* Advance the marquees that are due and draw the widgets that changed */
+static void mtxorb_widgets_update(struct mtxorb_priv *p, unsigned long now)
+{
+    struct mtxorb_widget *w;
+    unsigned long steps;
+    int i;
+
+    for (i = 0; i < WIDGET_MAX; i++)
+    {
+        w = &p->widgets[i];
+        if (w->type == wd_free)
+            continue;
+
+        /* Keep the speed when called late, skipping steps */
+        if ((w->type == wd_marquee) && (w->len > (size_t)w->width) &&
+            ((long)(now - w->next_step) >= 0))
+        {
+            steps = 1 + (now - w->next_step) / w->step_ms;
+            w->offset = (w->offset + steps) % (w->len + MARQUEE_GAP);
+            w->next_step += steps * w->step_ms;
+            w->dirty = 1;
+        }
+
+        if (w->dirty)
+            mtxorb_widget_draw(p, w);
+    }
+}
+
+/* Whether a widget changed since it was last drawn */
+static int mtxorb_widgets_dirty(struct mtxorb_priv *p)
+{
+    int i;
+
+    for (i = 0; i < WIDGET_MAX; i++)
+    {
+        if ((p->widgets[i].type != wd_free) && p->widgets[i].dirty)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Milliseconds until the next marquee step, 0 if due, -1 if nothing scrolls */
+static long mtxorb_widgets_next_step(struct mtxorb_priv *p, unsigned long now)
+{
+    struct mtxorb_widget *w;
+    long left, next = -1;
+    int i;
+
+    for (i = 0; i < WIDGET_MAX; i++)
+    {
+        w = &p->widgets[i];
+        if ((w->type != wd_marquee) || (w->len <= (size_t)w->width))
+            continue;
+
+        left = (long)(w->next_step - now);
+        if (left < 0)
+            left = 0;
+        if ((next == -1) || (left < next))
+            next = left;
+    }
+
+    return next;
+}
+
+/* Draw a widget's cells into the framebuffer. Only cells whose character
+ * changed end up in the next frame. */
+static void mtxorb_widget_draw(struct mtxorb_priv *p, struct mtxorb_widget *w)
+{
+    size_t k;
+    int i, pad = 0;
+    char c;
+
+    for (i = 0; i < w->width; i++)
+    {
+        if ((w->type == wd_marquee) && (w->len > (size_t)w->width))
+        {
+            /* The text wraps around after a gap */
+            k = (w->offset + i) % (w->len + MARQUEE_GAP);
+            c = (k < w->len) ? w->text[k] : ' ';
+        }
+        else if ((w->type == wd_number) && (w->len > (size_t)w->width))
+        {
+            /* A cut off number would show a wrong value */
+            c = '#';
+        }
+        else
+        {
+            if ((w->type == wd_number) || (w->align == MTXORB_ALIGN_RIGHT))
+                pad = w->width - (int)w->len;
+            else if (w->align == MTXORB_ALIGN_CENTER)
+                pad = (w->width - (int)w->len) / 2;
+            if (pad < 0)
+                pad = 0;
+
+            c = ((i >= pad) && ((size_t)(i - pad) < w->len)) ? w->text[i - pad] : ' ';
+        }
+
+        mtxorb_fb_putc(p, w->x + i, w->y, c);
+    }
+
+    w->dirty = 0;
+}
+
+/* Draw a big character with its top left cell at (x, y), returns its width.
+ * ids caches the custom characters of the glyphs, -1 if not looked up yet. */
+static int mtxorb_big_char(struct mtxorb_priv *p, int x, int y, char c, int *ids)
+{
+    const char *row;
+    size_t i;
+    int r, k;
+
+    for (i = 0; i < sizeof(big_chars) / sizeof(big_chars[0]) - 1; i++)
+    {
+        if (big_chars[i].c == c)
+            break;
+    }
+
+    /* Unknown characters end up at the blank, the last entry */
+    for (r = 0; r < 2; r++)
+    {
+        row = big_chars[i].rows[r];
+        for (k = 0; row[k] != '\0'; k++)
+            mtxorb_fb_putc(p, x + k, y + r, mtxorb_big_glyph(p, row[k], ids));
+    }
+
+    return strlen(big_chars[i].rows[0]);
+}
+
+/* Get the character of a glyph of the big characters, loading it into the
+ * display if needed. Full cells are the full block of the character ROM,
+ * a glyph without a free custom character is left blank. */
+static int mtxorb_big_glyph(struct mtxorb_priv *p, char kind, int *ids)
+{
+    char glyph[MAX_CELLHEIGHT];
+    int cw = p->device.cellwidth;
+    int ch = p->device.cellheight;
+    int bar = (ch + 2) / 4; /* thickness of the bars in pixels */
+    int dot, k, row, id;
+
+    if (kind == ' ')
+        return ' ';
+    if (kind == 'F')
+        return FULL_BLOCK;
+
+    k = strchr(BIG_KINDS, kind) - BIG_KINDS;
+    if (ids[k] >= 0)
+        return ids[k];
+
+    /* A dot leaves a pixel free on both sides, cells of 2 pixels or less
+     * are filled across */
+    dot = (cw > 2) ? ((1 << (cw - 2)) - 1) << 1 : (1 << cw) - 1;
+
+    for (row = 0; row < MAX_CELLHEIGHT; row++)
+    {
+        switch (kind)
+        {
+        case 'U':
+            glyph[row] = (row < bar) ? (1 << cw) - 1 : 0;
+            break;
+        case 'L':
+            glyph[row] = ((row >= ch - bar) && (row < ch)) ? (1 << cw) - 1 : 0;
+            break;
+        case 'B':
+            glyph[row] = ((row < bar) || ((row >= ch - bar) && (row < ch))) ? (1 << cw) - 1 : 0;
+            break;
+        default:
+            /* Square dot in the middle of the cell */
+            glyph[row] = ((row == ch / 2 - 1) || (row == ch / 2)) ? dot : 0;
+            break;
+        }
+    }
+
+    id = mtxorb_load_glyph(p, glyph);
+    ids[k] = (id < 0) ? ' ' : id;
+
+    return ids[k];
+}
+
+/* Append output to the trace, split into records of up to 65535 bytes.
+ * A record is the time since the previous one in us (4 bytes), the API
+ * id (1 byte), the length (2 bytes), all little-endian, and the bytes. */
+static void mtxorb_trace_record(struct mtxorb_priv *p, int api, const unsigned char *buf, size_t n)
+{
+    unsigned char hdr[7];
+    unsigned long now = mtxorb_now_us();
+    unsigned long delta = now - p->trace_last;
+    size_t len;
+
+    if (delta > 0xFFFFFFFFUL)
+        delta = 0xFFFFFFFFUL;
+
+    do
+    {
+        len = (n > 0xFFFF) ? 0xFFFF : n;
+
+        hdr[0] = delta & 0xFF;
+        hdr[1] = (delta >> 8) & 0xFF;
+        hdr[2] = (delta >> 16) & 0xFF;
+        hdr[3] = (delta >> 24) & 0xFF;
+        hdr[4] = api;
+        hdr[5] = len & 0xFF;
+        hdr[6] = (len >> 8) & 0xFF;
+
+        fwrite(hdr, 1, sizeof(hdr), p->trace);
+        fwrite(buf, 1, len, p->trace);
+
+        buf += len;
+        n -= len;
+        delta = 0;
+    } while (n > 0);
+
+    p->trace_last = now;
+}
+
+/* Monotonic time in microseconds, wraps around */
+static unsigned long mtxorb_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Monotonic time in milliseconds, wraps around */
+static unsigned long mtxorb_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Bytes a naive driver would send for the changed part of the framebuffer,
+ * a goto and the whole row for each row with a change */
+static size_t mtxorb_fb_repaint_cost(struct mtxorb_priv *p)
+{
+    size_t n = 0;
+    int y;
+
+    for (y = 0; y < p->device.height; y++)
+    {
+        if (memcmp(p->fb[y], p->shadow[y], p->device.width) != 0)
+            n += 4 + p->device.width;
+    }
+
+    return n;
+}
+
+/* Frame interval and budget of mtxorb_fb_tick(), from the refresh rate and
+ * the baud rate */
+static void mtxorb_update_rate(struct mtxorb_priv *p)
+{
+    if (p->fps == 0)
+    {
+        p->frame_ms = 0;
+        p->frame_budget = FRAME_MAX;
+        return;
+    }
+
+    /* 0 would turn the limit off, faster rates get a frame per ms */
+    p->frame_ms = 1000 / p->fps;
+    if (p->frame_ms < 1)
+        p->frame_ms = 1;
+
+    /* 8-N-1 takes 10 bits per byte on the wire */
+    p->frame_budget = p->baudrate / 10 / p->fps;
+
+    /* Always allow at least a goto and one character */
+    if (p->frame_budget < 5)
+        p->frame_budget = 5;
+    if (p->frame_budget > FRAME_MAX)
+        p->frame_budget = FRAME_MAX;
+}
+
+static void mtxorb_drop_glyphs(struct mtxorb_priv *p)
+{
+    int i;
+
+    for (i = 0; i < MAX_CC; i++)
+        p->cc_bank[i].valid = 0;
+}
+
+/* Whether a cell of the framebuffer or of the screen shows custom character id */
+static int mtxorb_glyph_shown(struct mtxorb_priv *p, int id)
+{
+    int x, y;
+
+    for (y = 0; y < p->device.height; y++)
+    {
+        for (x = 0; x < p->device.width; x++)
+        {
+            if ((p->fb[y][x] == id) || (p->shadow[y][x] == id))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void mtxorb_drop_pending(struct mtxorb_priv *p)
+{
+    int i;
+
+    for (i = 0; i < st_count; i++)
+        p->pending[i] = -1;
+}
+
+/* Output set by the fast path bypasses the cache of the output states.
+ * Forget the outputs it sets, and their queued commands so a newer value
+ * from mtxorb_set_output() isn't put ahead of it. */
+static void mtxorb_forget_outputs(struct mtxorb_priv *p, const unsigned char *buf, size_t n)
+{
+    size_t i = 0;
+    int gpo;
+
+    while (i + 1 < n)
+    {
+        if (buf[i] != 0xFE)
+        {
+            i++;
+            continue;
+        }
+
+        if ((buf[i + 1] == 'W') || (buf[i + 1] == 'V'))
+        {
+            gpo = (mtxorb_cmd_args(p, buf[i + 1]) > 0) && (i + 2 < n) ? buf[i + 2] - 1 : 0;
+            if ((gpo >= 0) && (gpo < GPO_COUNT))
+            {
+                p->state.gpo_known &= ~(1 << gpo);
+                p->pending[st_gpo + gpo] = -1;
+            }
+        }
+
+        i += 2 + mtxorb_cmd_args(p, buf[i + 1]);
+    }
+}
+
+/* Write as much of the queue as the port takes without blocking.
+ * Returns 1 if output is left, 0 if the queue is empty, -1 if error */
+static int mtxorb_drain(struct mtxorb_priv *p)
+{
+    int err;
+
+    LOCK(p);
+
+    /* Queued commands may be partly on the wire after this */
+    mtxorb_drop_pending(p);
+
+    p->outoff += mtxorb_write_some(p, p->outbuf + p->outoff, p->outlen - p->outoff, 0, &err);
+    if (err != EAGAIN)
+    {
+        p->outoff = 0;
+        p->outlen = 0;
+        if (err != 0)
+            STORE_SEQ(p->error, err);
+    }
+
+    UNLOCK(p);
+
+    if (err == EAGAIN)
+        return 1;
+
+    return (err != 0) ? -1 : 0;
+}
+
+/* Send the whole queue, waiting for the port if needed */
+static void mtxorb_flush_all(struct mtxorb_priv *p)
+{
+    LOCK(p);
+
+    if (p->outlen > p->outoff)
+        mtxorb_xmit(p, p->outbuf + p->outoff, p->outlen - p->outoff);
+
+    p->outoff = 0;
+    p->outlen = 0;
+    mtxorb_drop_pending(p);
+
+    UNLOCK(p);
+}
+
+/* Send the queue like mtxorb_flush(), but leave a write error for the
+ * application. Non-blocking ports never wait, what the port doesn't take
+ * stays queued for the next call or mtxorb_group_run(). Returns 1 if
+ * output is left, -1 if a write failed. */
+static int mtxorb_send_queue(struct mtxorb_priv *p)
+{
+    int ret = 0;
+
+    LOCK(p);
+
+    if (p->nonblock && !p->async)
+        ret = mtxorb_drain(p);
+    else
+        mtxorb_flush_all(p);
+
+    UNLOCK(p);
+
+    return ret;
+}
+
+/* Report and clear the error of the last failed write */
+static int mtxorb_take_error(struct mtxorb_priv *p)
+{
+    int err = __atomic_exchange_n(&p->error, 0, __ATOMIC_SEQ_CST);
+
+    if (err == 0)
+        return 0;
+
+    errno = err;
+    return -1;
+}
+
+/* Make room for n bytes in the queue of a non-blocking handle. Moves the unsent
+ * part to the front and only waits for the port if it is still too full. */
+static void mtxorb_make_room(struct mtxorb_priv *p, size_t n)
+{
+    struct pollfd fds[1];
+
+    fds[0].fd = p->fd;
+    fds[0].events = POLLOUT;
+
+    for (;;)
+    {
+        if (p->outoff > 0)
+        {
+            memmove(p->outbuf, p->outbuf + p->outoff, p->outlen - p->outoff);
+            p->outlen -= p->outoff;
+            p->outoff = 0;
+            mtxorb_drop_pending(p);
+        }
+
+        if ((p->outlen == 0) || (p->outlen + n <= OUTBUF_SIZE))
+            return;
+
+        mtxorb_pace_wait(p);
+        poll(fds, 1, -1);
+        if (mtxorb_drain(p) == -1)
+            return;
+    }
+}
+
+/* Hand bytes over to the port, or to the writer thread in async mode */
+static void mtxorb_xmit(struct mtxorb_priv *p, const void *buf, size_t n)
+{
+    if (p->async)
+        mtxorb_ring_push(p, buf, n);
+    else
+        mtxorb_write_all(p, buf, n);
+}
+
+static void mtxorb_xmitv(struct mtxorb_priv *p, const struct iovec *iov, int cnt)
+{
+    int i;
+
+    if (p->async)
+    {
+        for (i = 0; i < cnt; i++)
+            mtxorb_ring_push(p, iov[i].iov_base, iov[i].iov_len);
+    }
+    else
+        mtxorb_writev_all(p, iov, cnt);
+}
+
+/* Write everything, also when the port was opened non-blocking */
+static void mtxorb_write_all(struct mtxorb_priv *p, const unsigned char *buf, size_t n)
+{
+    int err;
+
+    mtxorb_write_some(p, buf, n, 1, &err);
+    if (err != 0)
+        STORE_SEQ(p->error, err);
+}
+
+/* Gathering version of mtxorb_write_all(). The segments go out with one
+ * writev() as long as the port takes them whole, what is left after a short
+ * write is finished segment by segment. */
+static void mtxorb_writev_all(struct mtxorb_priv *p, const struct iovec *iov, int cnt)
+{
+    size_t skip = 0;
+    ssize_t r;
+    int err = 0, k;
+
+    /* The rest of a command cut off earlier goes first */
+    if (p->resume_len > 0)
+    {
+        mtxorb_write_some(p, NULL, 0, 1, &err);
+        if (err != 0)
+        {
+            STORE_SEQ(p->error, err);
+            return;
+        }
+    }
+
+    while (cnt > 0)
+    {
+        k = (cnt < IOV_MAX) ? cnt : IOV_MAX;
+        r = mtxorb_sys_writev(p, iov, k);
+        if ((r == -1) && (errno == EINTR))
+            continue;
+        if (r == -1)
+            break;
+
+        /* Skip the segments that went out whole */
+        for (; (k > 0) && ((size_t)r >= iov->iov_len); iov++, cnt--, k--)
+            r -= iov->iov_len;
+
+        /* Short write, the port is full or gone */
+        if (k > 0)
+        {
+            skip = r;
+            break;
+        }
+    }
+
+    for (; cnt > 0; iov++, cnt--, skip = 0)
+    {
+        mtxorb_write_some(p, (const unsigned char *)iov->iov_base + skip, iov->iov_len - skip, 1, &err);
+        if (err != 0)
+            break;
+    }
+
+    if (err == 0)
+        return;
+
+    /* A command cut off by the failure may continue in the next segments */
+    for (iov++, cnt--; cnt > 0; iov++, cnt--)
+        mtxorb_save_resume(p, iov->iov_base, iov->iov_len);
+
+    STORE_SEQ(p->error, err);
+}
+
+/* Write buf to the port, after the rest of a command that was cut off by a
+ * failed write. Waits for the port when 'block' is set. Resumes short writes
+ * and returns the number of bytes of buf that are done with, *err is 0 or
+ * the errno of the failure. After EAGAIN the rest of buf is still to be
+ * written. Any other error means the port is gone: the rest of the current
+ * command is kept for later, so the display's parser stays in sync, and the
+ * commands after it are dropped. */
+static size_t mtxorb_write_some(struct mtxorb_priv *p, const unsigned char *buf, size_t n, int block, int *err)
+{
+    struct pollfd fds[1];
+    size_t done = 0;
+    ssize_t r;
+
+    fds[0].fd = p->fd;
+    fds[0].events = POLLOUT;
+    *err = 0;
+
+    while ((p->resume_len > 0) || (done < n))
+    {
+        if (p->resume_len > 0)
+            r = mtxorb_sys_write(p, p->resume, p->resume_len);
+        else
+            r = mtxorb_sys_write(p, buf + done, n - done);
+
+        if ((r > 0) && (p->resume_len > 0))
+        {
+            p->resume_len -= r;
+            memmove(p->resume, p->resume + r, p->resume_len);
+        }
+        else if (r > 0)
+            done += r;
+        else if ((r == -1) && (errno == EINTR))
+            continue;
+        else if ((r == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {
+            if (!block)
+            {
+                *err = EAGAIN;
+                return done;
+            }
+            /* Held back by pacing, or the port is full */
+            mtxorb_pace_wait(p);
+            poll(fds, 1, -1);
+        }
+        else
+        {
+            *err = (r == -1) ? errno : EIO;
+            if (mtxorb_is_hangup(*err))
+                STORE_SEQ(p->hangup, 1);
+            STORE_SEQ(p->dropped, 1);
+            if (p->resume_len == 0)
+                mtxorb_save_resume(p, buf + done, n - done);
+            return n;
+        }
+    }
+
+    return done;
+}
+
+/* Keep the bytes of buf that complete the command the display's parser is
+ * in the middle of. Appends to what is kept already, for commands that were
+ * gathered from several segments. */
+static void mtxorb_save_resume(struct mtxorb_priv *p, const unsigned char *buf, size_t n)
+{
+    int left = p->wire_left;
+    size_t i;
+
+    for (i = 0; (left != 0) && (i < p->resume_len); i++)
+        left = (left == -1) ? mtxorb_cmd_args(p, p->resume[i]) : left - 1;
+
+    for (i = 0; (left != 0) && (i < n) && (p->resume_len < RESUME_SIZE); i++)
+    {
+        left = (left == -1) ? mtxorb_cmd_args(p, buf[i]) : left - 1;
+        p->resume[p->resume_len++] = buf[i];
+    }
+}
+
+/* Complete what is kept in 'resume' to the end of the command the display's
+ * parser is in, for when the bytes that would finish it were dropped. Pads
+ * missing arguments with zeros, a missing opcode with go home. */
+static void mtxorb_pad_resume(struct mtxorb_priv *p)
+{
+    int left = p->wire_left;
+    size_t i;
+
+    for (i = 0; (left != 0) && (i < p->resume_len); i++)
+        left = (left == -1) ? mtxorb_cmd_args(p, p->resume[i]) : left - 1;
+
+    for (; (left != 0) && (p->resume_len < RESUME_SIZE); p->resume_len++)
+    {
+        p->resume[p->resume_len] = (left == -1) ? 'H' : 0;
+        left = (left == -1) ? mtxorb_cmd_args(p, 'H') : left - 1;
+    }
+}
+
+static ssize_t mtxorb_sys_write(struct mtxorb_priv *p, const void *buf, size_t n)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = n;
+
+    return mtxorb_sys_writev(p, &iov, 1);
+}
+
+/* writev() to the port, keeping the write counters and latency histogram */
+static ssize_t mtxorb_sys_writev(struct mtxorb_priv *p, const struct iovec *iov, int cnt)
+{
+    const unsigned char *c;
+    struct iovec part;
+    struct timespec t0, t1;
+    unsigned long us;
+    size_t n = 0, k, cut = 0;
+    ssize_t r, left;
+    int i, paced = 0, queued;
+
+    /* Wait out the last slow command and stop after the next one. The
+     * callers write the rest like after any short write. Non-blocking
+     * handles don't sleep, to them the port is full until the gap is over. */
+    if (p->pace_us > 0)
+    {
+        if (!mtxorb_pace_nowait(p))
+            mtxorb_pace_wait(p);
+        else if (mtxorb_pace_left(p) > 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        cut = mtxorb_pace_cut(p, iov, cnt);
+        if (cut > 0)
+        {
+            for (i = 0; cut > iov[i].iov_len; i++)
+                cut -= iov[i].iov_len;
+
+            if (cut == iov[i].iov_len)
+            {
+                cnt = i + 1;
+                paced = 1;
+            }
+            else if (i == 0)
+            {
+                part.iov_base = iov[0].iov_base;
+                part.iov_len = cut;
+                iov = &part;
+                cnt = 1;
+                paced = 1;
+            }
+            else
+                cnt = i;
+        }
+    }
+
+    for (i = 0; i < cnt; i++)
+        n += iov[i].iov_len;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r = writev(p->fd, iov, cnt);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    us = (unsigned long)(t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_nsec / 1000 - t0.tv_nsec / 1000;
+
+    /* Bucket i counts durations below 2^i microseconds */
+    for (i = 0; (i < MTXORB_LATENCY_BUCKETS - 1) && (us >= (1UL << i)); i++)
+        ;
+
+    /* Follow the display's command parser */
+    for (left = r; left > 0; iov++)
+    {
+        c = iov->iov_base;
+        for (k = 0; (k < iov->iov_len) && (left > 0); k++, left--)
+        {
+            if (p->wire_left > 0)
+                p->wire_left--;
+            else if (p->wire_left == -1)
+            {
+                p->wire_op = c[k];
+                p->wire_left = mtxorb_cmd_args(p, c[k]);
+            }
+            else if (c[k] == 0xFE)
+                p->wire_left = -1;
+        }
+    }
+
+    STAT_ADD(p->stats.write_calls, 1);
+    STAT_ADD(p->stats.write_latency[i], 1);
+    if (r > 0)
+        STAT_ADD(p->stats.bytes_written, (unsigned long)r);
+    if (r == -1)
+        STAT_ADD(p->stats.failed_writes, 1);
+    else if ((size_t)r < n)
+        STAT_ADD(p->stats.short_writes, 1);
+
+    /* The gap starts when the slow command has left the port. Without
+     * waiting for that, count the bytes still queued in the driver at 10
+     * bits each instead. */
+    if (paced && (r == (ssize_t)n))
+    {
+        if (!mtxorb_pace_nowait(p))
+        {
+            tcdrain(p->fd);
+            p->pace_due = mtxorb_now_us() + p->pace_us;
+        }
+        else
+        {
+            if (ioctl(p->fd, TIOCOUTQ, &queued) == -1)
+                queued = 0;
+            p->pace_due = mtxorb_now_us() + p->pace_us + queued * 10000000UL / p->baudrate;
+        }
+        STAT_ADD(p->stats.pauses, 1);
+    }
+
+    return r;
+}
+
+/* Commands the module takes long to carry out */
+static int mtxorb_is_slow(unsigned char op)
+{
+    switch (op)
+    {
+    case 'X':
+    case 'N':
+    case 'h':
+    case 'v':
+    case 's':
+    case 'm':
+    case 'n':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Number of bytes up to and including the end of the first slow command,
+ * 0 if there is none */
+static size_t mtxorb_pace_cut(struct mtxorb_priv *p, const struct iovec *iov, int cnt)
+{
+    const unsigned char *c;
+    unsigned char op = p->wire_op;
+    int left = p->wire_left;
+    size_t pos = 0, k;
+    int i;
+
+    for (i = 0; i < cnt; i++)
+    {
+        c = iov[i].iov_base;
+        for (k = 0; k < iov[i].iov_len; k++)
+        {
+            pos++;
+            if (left > 0)
+            {
+                if ((--left == 0) && mtxorb_is_slow(op))
+                    return pos;
+            }
+            else if (left == -1)
+            {
+                op = c[k];
+                left = mtxorb_cmd_args(p, op);
+                if ((left == 0) && mtxorb_is_slow(op))
+                    return pos;
+            }
+            else if (c[k] == 0xFE)
+                left = -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Microseconds until the gap after the last slow command is over */
+static long mtxorb_pace_left(struct mtxorb_priv *p)
+{
+    long us;
+
+    if (p->pace_us == 0)
+        return 0;
+
+    us = (long)(p->pace_due - mtxorb_now_us());
+
+    return (us > 0) ? us : 0;
+}
+
+/* Non-blocking handles written from the calling thread, e.g. grouped ones,
+ * must not sleep for pacing */
+static int mtxorb_pace_nowait(struct mtxorb_priv *p)
+{
+    return p->nonblock && !p->async;
+}
+
+/* Sleep until the gap after the last slow command is over */
+static void mtxorb_pace_wait(struct mtxorb_priv *p)
+{
+    struct timespec ts;
+    long us = mtxorb_pace_left(p);
+
+    if (us <= 0)
+        return;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR))
+        ;
+}
+
+/* Count the commands and text in a chunk of output. Raw data written with
+ * mtxorb_write() isn't guaranteed to hold whole commands, so this is a
+ * best guess for it. */
+static void mtxorb_count_commands(struct mtxorb_priv *p, const unsigned char *buf, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n)
+    {
+        if (buf[i] != 0xFE)
+        {
+            p->stats.text_bytes++;
+            i++;
+            continue;
+        }
+
+        if (i + 1 == n)
+            break;
+
+        p->stats.commands[buf[i + 1]]++;
+        i += 2 + mtxorb_cmd_args(p, buf[i + 1]);
+    }
+}
+
+/* Number of argument bytes following a command's opcode */
+static int mtxorb_cmd_args(struct mtxorb_priv *p, unsigned char op)
+{
+    switch (op)
+    {
+    case 'N':
+        return 9;
+    case '|':
+        return 4;
+    case 'o':
+    case 0x82:
+        return 3;
+    case 'G':
+    case '=':
+    case '#':
+        return 2;
+    case 'B':
+    case 'P':
+    case 'Y':
+    case 'U':
+    case '9':
+    case 0x7E:
+    case 0x99:
+    case 0x9C:
+        return 1;
+    case 'V':
+    case 'W':
+        /* Only keypad modules have more than one output */
+        return HAS_CAP(p, CAP_KEYPAD) ? 1 : 0;
+    default:
+        return 0;
+    }
+}
+
+/* Copy bytes into the async ring. Only waits if the ring is full, i.e. the
+ * application produces faster than the link can carry. */
+static void mtxorb_ring_push(struct mtxorb_priv *p, const unsigned char *buf, size_t n)
+{
+    size_t head = p->ring_head;
+    size_t space, off, chunk;
+
+    while (n > 0)
+    {
+        space = RING_SIZE - (head - LOAD_ACQUIRE(p->ring_tail));
+        if (space == 0)
+        {
+            mtxorb_wake_writer(p);
+            poll(NULL, 0, 1);
+            continue;
+        }
+
+        off = head & (RING_SIZE - 1);
+        chunk = n;
+        if (chunk > space)
+            chunk = space;
+        if (chunk > RING_SIZE - off)
+            chunk = RING_SIZE - off;
+
+        memcpy(p->ring + off, buf, chunk);
+        buf += chunk;
+        n -= chunk;
+        head += chunk;
+        STORE_SEQ(p->ring_head, head);
+    }
+
+    /* Only costs a syscall when the writer went to sleep */
+    if (LOAD_SEQ(p->writer_idle))
+        mtxorb_wake_writer(p);
+}
+
+static void mtxorb_wake_writer(struct mtxorb_priv *p)
+{
+    char c = 0;
+
+    Write(p->wake[1], &c, 1);
+}
+
+/* Writer thread, drains the ring to the port */
+static void *mtxorb_writer(void *arg)
+{
+    struct mtxorb_priv *p = arg;
+    struct pollfd fds[2];
+    size_t head, tail = p->ring_tail;
+    size_t off, n;
+    int err;
+    char junk[16];
+
+    fds[0].fd = p->wake[0];
+    fds[0].events = POLLIN;
+
+    for (;;)
+    {
+        head = LOAD_ACQUIRE(p->ring_head);
+
+        if (head == tail)
+        {
+            if (LOAD_SEQ(p->writer_stop))
+                break;
+
+            /* Announce we are going to sleep, then check again so a push
+             * that raced with us is not missed */
+            STORE_SEQ(p->writer_idle, 1);
+            if ((LOAD_SEQ(p->ring_head) == tail) && !LOAD_SEQ(p->writer_stop))
+            {
+                poll(fds, 1, -1);
+                while (read(p->wake[0], junk, sizeof(junk)) > 0)
+                    ;
+            }
+            STORE_SEQ(p->writer_idle, 0);
+            continue;
+        }
+
+        /* Write the contiguous part up to the end of the ring */
+        off = tail & (RING_SIZE - 1);
+        n = head - tail;
+        if (n > RING_SIZE - off)
+            n = RING_SIZE - off;
+
+        /* A port that is gone drops the data rather than spin */
+        tail += mtxorb_write_some(p, p->ring + off, n, 0, &err);
+        STORE_RELEASE(p->ring_tail, tail);
+
+        if (err == EAGAIN)
+        {
+            /* Non-blocking port, wait until it takes more */
+            fds[1].fd = p->fd;
+            fds[1].events = POLLOUT;
+            poll(&fds[1], 1, -1);
+        }
+        else if (err != 0)
+            STORE_SEQ(p->error, err);
+    }
+
+    return NULL;
+}
+
+static void mtxorb_set_key_auto_tx(MTXORB *handle, enum mtxorb_onoff on)
+{
+    struct mtxorb_priv *p = handle;
+    unsigned char out[] = {'\xFE', 0};
+
+    if (HAS_CAP(p, CAP_KEYPAD))
+    {
+        out[1] = (on == MTXORB_ON) ? 'A' : 'O';
+        mtxorb_emit(p, out, 2);
+    }
+}
+
+static speed_t mtxorb_baud_to_speed(int baudrate)
+{
+    switch (baudrate)
+    {
+    case 1200:
+        return B1200;
+    case 2400:
+        return B2400;
+    case 4800:
+        return B4800;
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+#ifdef B115200
+    case 115200:
+        return B115200;
+#endif
+#ifdef B230400
+    case 230400:
+        return B230400;
+#endif
+#ifdef B460800
+    case 460800:
+        return B460800;
+#endif
+#ifdef B921600
+    case 921600:
+        return B921600;
+#endif
+    default:
+        return B0;
+    }
+}
+
+/* Change the speed of an open port, any rate where termios2 is available */
+static int mtxorb_set_port_speed(int fd, int baudrate)
+{
+    struct termios tio;
+#if HAVE_TERMIOS2
+    struct termios2 tio2;
+#endif
+    speed_t speed = mtxorb_baud_to_speed(baudrate);
+
+    if (speed != B0)
+    {
+        if (tcgetattr(fd, &tio) == -1)
+            return -1;
+
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+
+        return tcsetattr(fd, TCSADRAIN, &tio);
+    }
+
+#if HAVE_TERMIOS2
+    if (ioctl(fd, TCGETS2, &tio2) == -1)
+        return -1;
+
+    tio2.c_cflag &= ~CBAUD;
+    tio2.c_cflag |= K_BOTHER;
+    tio2.c_ispeed = baudrate;
+    tio2.c_ospeed = baudrate;
+
+    return ioctl(fd, TCSETSW2, &tio2);
+#else
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
+/* Ask the serial driver to push received bytes to us right away */
+static void mtxorb_set_low_latency(int fd)
+{
+#if defined(__linux__) && defined(TIOCGSERIAL)
+    struct serial_struct ss;
+
+    if (ioctl(fd, TIOCGSERIAL, &ss) == -1)
+        return;
+
+    ss.flags |= ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &ss);
+#else
+    (void)fd;
+#endif
+}
+
+/* Program the latency timer of FTDI USB-serial adapters through sysfs,
+ * if the port is one */
+static void mtxorb_set_ftdi_latency(const char *portname, int latency)
+{
+#ifdef __linux__
+    char path[PATH_MAX];
+    char sysfs[96];
+    const char *name;
+    FILE *f;
+
+    /* Resolve links like /dev/serial/by-id/... to the tty name */
+    if (realpath(portname, path) == NULL)
+        return;
+
+    name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+
+    /* tty names are short, anything else is not a usb-serial port */
+    if (strlen(name) > 32)
+        return;
+
+    strcpy(sysfs, "/sys/bus/usb-serial/devices/");
+    strcat(sysfs, name);
+    strcat(sysfs, "/latency_timer");
+
+    if ((f = fopen(sysfs, "w")) == NULL)
+        return;
+
+    fprintf(f, "%d\n", latency);
+    fclose(f);
+#else
+    (void)portname;
+    (void)latency;
+#endif
+}
+
+/* Open the port and set it up for the display, saving the settings found
+ * in oldtio. Returns the file descriptor, or -1 if error. */
+static int mtxorb_open_port(const char *portname, int baudrate, const struct mtxorb_open_options *opts,
+                            struct termios *oldtio)
+{
+    struct termios newtio;
+    speed_t speed;
+    int fd, err;
+
+    /* Non-standard rates are set after the port is configured */
+    speed = mtxorb_baud_to_speed(baudrate);
+    if ((speed == B0) && !HAVE_TERMIOS2)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((fd = open(portname, O_RDWR | O_NOCTTY | (opts->nonblock ? O_NONBLOCK : 0))) == -1)
+        return -1;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    /* Save current port settings */
+    tcgetattr(fd, oldtio);
+
+    /* 8-N-1, blocking read by default unless using poll, select or
+     * the port is opened non-blocking */
+    memset(&newtio, 0, sizeof(struct termios));
+    newtio.c_cflag = ((speed != B0) ? speed : B38400) | CS8 | CLOCAL | CREAD;
+    /* No CR translation, replies to queries are binary */
+    newtio.c_iflag = IGNPAR;
+    newtio.c_cc[VMIN] = opts->vmin;
+    newtio.c_cc[VTIME] = opts->vtime;
+
+    if (opts->flow_control == MTXORB_FLOW_RTSCTS)
+        newtio.c_cflag |= CRTSCTS;
+    else if (opts->flow_control == MTXORB_FLOW_XONXOFF)
+    {
+        newtio.c_iflag |= IXON;
+        newtio.c_cc[VSTART] = 0x11;
+        newtio.c_cc[VSTOP] = 0x13;
+    }
+
+    /* Flush input buffer and apply new settings */
+    tcflush(fd, TCIFLUSH);
+    if ((tcsetattr(fd, TCSANOW, &newtio) == -1) ||
+        ((speed == B0) && (mtxorb_set_port_speed(fd, baudrate) == -1)))
+    {
+        err = errno;
+        tcsetattr(fd, TCSANOW, oldtio);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    /* Both are best effort, not every serial driver supports them */
+    if (opts->low_latency)
+        mtxorb_set_low_latency(fd);
+    if (opts->ftdi_latency > 0)
+        mtxorb_set_ftdi_latency(portname, opts->ftdi_latency);
+
+    return fd;
+}
+
+/* Bring a display back to the cached state: settings, custom characters and
+ * the framebuffer. What was queued is dropped. After a reset the display's
+ * command parser starts afresh; one that kept its state ('warm') may still
+ * wait for the rest of a command cut off when the port was lost, which is
+ * finished first. */
+static void mtxorb_replay_state(struct mtxorb_priv *p, int warm)
+{
+    struct mtxorb_state st = p->state;
+    struct mtxorb_glyph_slot bank[MAX_CC];
+    enum mtxorb_cc_mode mode = p->cc_mode;
+    unsigned char out[2];
+    int i;
+
+    memcpy(bank, p->cc_bank, sizeof(bank));
+
+    p->outoff = 0;
+    p->outlen = 0;
+    mtxorb_drop_pending(p);
+    if (warm)
+        mtxorb_pad_resume(p);
+    else
+    {
+        p->wire_left = 0;
+        p->resume_len = 0;
+    }
+
+    /* Forget the cache so the setters send every value */
+    mtxorb_invalidate_state(p);
+
+    mtxorb_clear(p);
+    if (st.cursor_block != -1)
+        mtxorb_set_cursor_block(p, st.cursor_block ? MTXORB_ON : MTXORB_OFF);
+    if (st.cursor_uline != -1)
+        mtxorb_set_cursor_uline(p, st.cursor_uline ? MTXORB_ON : MTXORB_OFF);
+    if (st.auto_scroll != -1)
+        mtxorb_set_auto_scroll(p, st.auto_scroll ? MTXORB_ON : MTXORB_OFF);
+    if (st.line_wrap != -1)
+        mtxorb_set_auto_line_wrap(p, st.line_wrap ? MTXORB_ON : MTXORB_OFF);
+    if (st.contrast != -1)
+        mtxorb_set_contrast(p, st.contrast);
+    if (st.brightness != -1)
+        mtxorb_set_brightness(p, st.brightness);
+    if (st.bg_color != -1)
+        mtxorb_set_bg_color(p, (st.bg_color >> 16) & 0xFF, (st.bg_color >> 8) & 0xFF, st.bg_color & 0xFF);
+    if (st.keypad_brightness != -1)
+        mtxorb_set_keypad_brightness(p, st.keypad_brightness);
+    if (st.gpo_known != 0)
+        mtxorb_set_output_mask(p, st.gpo_known, st.gpo);
+    if (st.key_debounce != -1)
+        mtxorb_set_key_debounce_time(p, st.key_debounce);
+    if (st.key_auto_repeat != -1)
+        mtxorb_set_key_auto_repeat(p, st.key_auto_repeat ? MTXORB_ON : MTXORB_OFF);
+    mtxorb_set_key_auto_tx(p, MTXORB_ON);
+
+    /* The character set the framebuffer refers to */
+    out[0] = '\xFE';
+    out[1] = 0;
+    switch (mode)
+    {
+    case cc_custom:
+        for (i = 0; i < MAX_CC; i++)
+        {
+            if (bank[i].valid)
+                mtxorb_set_custom_char(p, i, (const char *)bank[i].data);
+        }
+        memcpy(p->cc_bank, bank, sizeof(bank));
+        break;
+    case cc_hbar:
+    case cc_vbar_narrow:
+        /* As mtxorb_hbar() and mtxorb_vbar() initialize them */
+        out[1] = 'h';
+        break;
+    case cc_vbar_wide:
+        out[1] = 'v';
+        break;
+    case cc_bignum_medium:
+        out[1] = 'm';
+        break;
+    case cc_bignum_large:
+        out[1] = 'n';
+        break;
+    default:
+        break;
+    }
+    if (out[1] != 0)
+    {
+        mtxorb_emit(p, out, 2);
+        p->cc_mode = mode;
+    }
+
+    /* Only cells that aren't blank are painted */
+    mtxorb_fb_present(p);
+}
+
+/* Queue bytes from the port as key events, returns the number queued */
+static size_t mtxorb_queue_keys(struct mtxorb_priv *p, const unsigned char *buf, size_t n)
+{
+    struct mtxorb_key_event *ev;
+    struct timespec now;
+    size_t i;
+
+    /* The rest of a reply that timed out comes first */
+    if (mtxorb_late_reply(p))
+    {
+        i = (n < p->late_reply) ? n : p->late_reply;
+        p->late_reply -= i;
+        buf += i;
+        n -= i;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < n; i++)
+    {
+        if (p->key_head - p->key_tail == KEY_RING_SIZE)
+        {
+            p->key_tail++;
+            p->stats.keys_dropped++;
+        }
+
+        ev = &p->keys[p->key_head++ % KEY_RING_SIZE];
+        ev->key = buf[i];
+        ev->sec = now.tv_sec;
+        ev->usec = now.tv_nsec / 1000;
+    }
+
+    p->stats.key_events += n;
+
+    return n;
+}
+
+/* Whether reply bytes of a timed out query may still arrive */
+static int mtxorb_late_reply(struct mtxorb_priv *p)
+{
+    if ((p->late_reply > 0) && ((long)(mtxorb_now_ms() - p->late_until) >= 0))
+        p->late_reply = 0;
+
+    return (p->late_reply > 0);
+}
+
+/* Read up to n bytes, waiting no longer than the deadline. Returns the
+ * number of bytes read. */
+static size_t mtxorb_read_until(struct mtxorb_priv *p, unsigned char *buf, size_t n, const struct timespec *deadline)
+{
+    struct pollfd fds[1];
+    size_t got = 0;
+    ssize_t r;
+    int ret;
+
+    fds[0].fd = p->fd;
+    fds[0].events = POLLIN;
+
+    while (got < n)
+    {
+        fds[0].revents = 0;
+        ret = poll(fds, 1, mtxorb_ms_left(deadline));
+        if ((ret == -1) && (errno == EINTR))
+            continue;
+        if (ret <= 0)
+            break;
+        if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+        {
+            STORE_SEQ(p->hangup, 1);
+            break;
+        }
+
+        r = read(p->fd, buf + got, n - got);
+        if (r > 0)
+            got += r;
+        else if ((r == -1) && ((errno == EINTR) || (errno == EAGAIN)))
+            continue;
+        else
+            break;
+    }
+
+    return got;
+}
+
+/* Set the deadline to ms milliseconds from now */
+static void mtxorb_deadline(struct timespec *deadline, int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Milliseconds until the deadline, rounded up, 0 if it has passed */
+static int mtxorb_ms_left(const struct timespec *deadline)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+    return (ms > 0) ? (int)ms : 0;
+}
+
+/* Write a command right away, past the queue and the ring */
+static void mtxorb_send_now(struct mtxorb_priv *p, const unsigned char *buf, size_t n)
+{
+    mtxorb_count_commands(p, buf, n);
+    if (p->trace != NULL)
+        mtxorb_trace_record(p, p->api, buf, n);
+    mtxorb_write_all(p, buf, n);
+}
+
+/* errno values of a port that is gone, e.g. an unplugged USB adapter */
+static int mtxorb_is_hangup(int err)
+{
+    return (err == EIO) || (err == ENXIO) || (err == ENODEV);
+}
+
+static unsigned int mtxorb_device_caps(enum mtxorb_type type)
+{
+    switch (type)
+    {
+    case MTXORB_LCD:
+        return CAP_CONTRAST;
+    case MTXORB_LKD:
+        return CAP_KEYPAD | CAP_CONTRAST | CAP_RGB;
+    case MTXORB_VFD:
+        return CAP_BRIGHTNESS;
+    case MTXORB_VKD:
+        return CAP_KEYPAD | CAP_BRIGHTNESS;
+    default:
+        return 0;
     }
 }
 
@@ -47,6 +47,23 @@ enum mtxorb_gpo_flags {
     MTXORB_GPO6 = (1<<5)
 };
 
+enum mtxorb_align {
+    MTXORB_ALIGN_LEFT,
+    MTXORB_ALIGN_RIGHT,
+    MTXORB_ALIGN_CENTER
+};
+
+enum mtxorb_icon {
+    MTXORB_ICON_HEART,
+    MTXORB_ICON_BELL,
+    MTXORB_ICON_ARROW_UP,
+    MTXORB_ICON_ARROW_DOWN,
+    MTXORB_ICON_CHECK,
+    MTXORB_ICON_CROSS,
+    MTXORB_ICON_LOCK,
+    MTXORB_ICON_DEGREE
+};
+
 enum mtxorb_type {
     MTXORB_LCD,     /* standard lcd */
     MTXORB_LKD,     /* lcd w/keypad */
@@ -62,23 +79,317 @@ struct mtxorb_device_info {
     enum mtxorb_type type;  /* display model type */
 };
 
+struct mtxorb_key_event {
+    unsigned char key;      /* key code as sent by the display */
+    long sec;               /* time of arrival, CLOCK_MONOTONIC */
+    long usec;
+};
+
+/* What mtxorb_probe() found out about a module */
+struct mtxorb_module {
+    int type;               /* module type code */
+    int version;            /* firmware version, e.g. 0x57 for 5.7 */
+    const char *name;       /* model name, NULL if the type code is unknown */
+    struct mtxorb_device_info info; /* valid if the model is known */
+};
+
+/* State of the display after the port was lost, see mtxorb_reconnect() */
+enum mtxorb_restart {
+    MTXORB_RESTART_WARM,    /* the display kept its state */
+    MTXORB_RESTART_COLD     /* the display was reset */
+};
+
+/* Flow control of the output, see mtxorb_open_ex() */
+enum mtxorb_flow {
+    MTXORB_FLOW_NONE,
+    MTXORB_FLOW_RTSCTS,     /* hardware handshake, RTS/CTS lines */
+    MTXORB_FLOW_XONXOFF     /* software handshake, bytes 0x11/0x13 from the module */
+};
+
+/*
+ * Serial port tuning for mtxorb_open_ex(). Initialize with
+ * mtxorb_init_open_options() and change what you need.
+ */
+struct mtxorb_open_options {
+    int low_latency;        /* request ASYNC_LOW_LATENCY from the driver (default: 0) */
+    int ftdi_latency;       /* FTDI latency timer in ms, 1-255, 0 = leave as is (default: 0) */
+    int nonblock;           /* open the port with O_NONBLOCK, see mtxorb_flush() (default: 0) */
+    int vmin;               /* termios VMIN, 0-255 (default: 1) */
+    int vtime;              /* termios VTIME in 1/10 s, 0-255 (default: 0) */
+    int threadsafe;         /* serialize output for mtxorb_batch_commit() (default: 0) */
+    int flow_control;       /* enum mtxorb_flow (default: MTXORB_FLOW_NONE) */
+    int pace_us;            /* gap after slow commands in us, 0 = none (default: 0) */
+};
+
+/*
+ * Public functions as recorded in a trace, see mtxorb_trace_open(). Output is
+ * attributed to the function that encoded it, e.g. glyphs loaded by
+ * mtxorb_fb_hbar() show up as MTXORB_API_SET_CUSTOM_CHAR. The values are
+ * part of the trace format and never change.
+ */
+enum mtxorb_api {
+    MTXORB_API_NONE,
+    MTXORB_API_CLEAR,
+    MTXORB_API_PUTC,
+    MTXORB_API_PUTS,
+    MTXORB_API_WRITE,
+    MTXORB_API_GOTOXY,
+    MTXORB_API_SET_CURSOR_BLOCK,
+    MTXORB_API_SET_CURSOR_ULINE,
+    MTXORB_API_SET_AUTO_SCROLL,
+    MTXORB_API_SET_AUTO_LINE_WRAP,
+    MTXORB_API_SET_CUSTOM_CHAR,
+    MTXORB_API_HBAR,
+    MTXORB_API_VBAR,
+    MTXORB_API_BIGNUM,
+    MTXORB_API_BACKLIGHT_OFF,
+    MTXORB_API_SET_CONTRAST,
+    MTXORB_API_SET_BRIGHTNESS,
+    MTXORB_API_SET_BG_COLOR,
+    MTXORB_API_SET_OUTPUT,
+    MTXORB_API_KEYPAD_BACKLIGHT_OFF,
+    MTXORB_API_SET_KEYPAD_BRIGHTNESS,
+    MTXORB_API_SET_KEY_AUTO_REPEAT,
+    MTXORB_API_SET_KEY_DEBOUNCE_TIME,
+    MTXORB_API_FB_PRESENT,
+    MTXORB_API_FB_TICK,
+    MTXORB_API_SET_BAUDRATE,
+    MTXORB_API_WRITEV,
+    MTXORB_API_COMMIT,
+    MTXORB_API_BATCH,
+    MTXORB_API_QUERY
+};
+
+#define MTXORB_LATENCY_BUCKETS 20
+
+/*
+ * Counters of a handle, see mtxorb_get_stats().
+ */
+struct mtxorb_stats {
+    unsigned long bytes_written;    /* bytes taken by write() */
+    unsigned long write_calls;      /* write() system calls on the port */
+    unsigned long short_writes;     /* writes that took less than offered */
+    unsigned long failed_writes;    /* writes that returned an error, EAGAIN included */
+    unsigned long text_bytes;       /* text bytes sent */
+    unsigned long commands[256];    /* commands sent, by opcode (the byte after 0xFE) */
+    unsigned long bytes_saved;      /* bytes not sent thanks to caching, collapsing and diffing */
+    unsigned long key_events;       /* key events received */
+    unsigned long keys_dropped;     /* key events lost because the queue was full */
+    unsigned long write_latency[MTXORB_LATENCY_BUCKETS];
+                                    /* write() durations, bucket i counts durations below
+                                     * 2^i microseconds, the last bucket everything longer */
+    unsigned long pauses;           /* gaps inserted after slow commands, see 'pace_us' */
+    unsigned long glyphs_missed;    /* glyphs not loaded because every custom character was shown */
+};
+
 typedef void MTXORB;
+typedef void MTXORB_GROUP;
+
+/*
+ * Storage for a handle opened with mtxorb_open_static(). It is one block
+ * holding every buffer of the handle, nothing else is allocated. The
+ * fields used on every call are at the start, align the storage to 64
+ * bytes (e.g. with GCC's aligned attribute) to keep them in one cache
+ * line. Builds with MTXORB_NO_MALLOC defined (for both the library and its
+ * users) leave out mtxorb_open(), mtxorb_open_ex() and the group
+ * allocation.
+ */
+#define MTXORB_HANDLE_SIZE 16384
+
+union mtxorb_storage {
+    unsigned char bytes[MTXORB_HANDLE_SIZE];
+    long double align_ld;   /* aligned for any member of the handle */
+    void *align_ptr;
+    long align_l;
+};
 
 
+#ifndef MTXORB_NO_MALLOC
 /**
  * Open a session for controlling a display.
  * @portname:   device port name, e.g. '/dev/ttyS0' or '/dev/ttyUSB0'
- * @baudrate:   communication speed. Valid values: 9600, 19200, 38400 and 57600.
- * @info:       pointer to display device info
+ * @baudrate:   communication speed, e.g. 9600, 19200, 38400, 57600 or 115200.
+ *              Any rate the serial driver supports is accepted on Linux.
+ * @info:       pointer to display device info, copied into the handle, or
+ *              NULL to probe the module, see mtxorb_probe()
  * @return valid handle or NULL in case of error
  */
 extern MTXORB *mtxorb_open(const char *portname, int baudrate, const struct mtxorb_device_info *info);
 
+/**
+ * Fill in the default open options, which match mtxorb_open().
+ * @opts:   pointer to options
+ */
+extern void mtxorb_init_open_options(struct mtxorb_open_options *opts);
+
+/**
+ * Open a session with serial port tuning, see mtxorb_open().
+ * Low latency and the FTDI latency timer are applied on a best effort basis,
+ * when the driver doesn't support them the port is opened anyway.
+ * A module without flow control can lose bytes that arrive while it
+ * carries out a slow command. With 'pace_us' the library waits until such
+ * a command (clear, bar and number init, custom characters) is on the wire
+ * and then that much longer before writing on; the writing thread sleeps
+ * for it. Non-blocking and grouped displays don't sleep, their output waits
+ * in the queue and mtxorb_group_run() resumes it after the gap.
+ * With XON/XOFF the bytes 0x11 and 0x13 never reach the application,
+ * replies to queries must not contain them.
+ * @opts:   pointer to options, NULL for defaults
+ * @return valid handle or NULL in case of error
+ */
+extern MTXORB *mtxorb_open_ex(const char *portname, int baudrate, const struct mtxorb_device_info *info,
+                              const struct mtxorb_open_options *opts);
+#endif /* MTXORB_NO_MALLOC */
+
+/**
+ * Open a session in caller-provided storage, see mtxorb_open_ex(). The
+ * storage is used until mtxorb_close(), which doesn't free it.
+ * @storage:    storage for the handle, e.g. a static union mtxorb_storage
+ * @size:       size of the storage, at least mtxorb_handle_size()
+ * @opts:       pointer to options, NULL for defaults
+ * @return handle in the storage or NULL in case of error
+ */
+extern MTXORB *mtxorb_open_static(void *storage, size_t size, const char *portname, int baudrate,
+                                  const struct mtxorb_device_info *info,
+                                  const struct mtxorb_open_options *opts);
+
+/**
+ * Get the storage size a handle needs, at most MTXORB_HANDLE_SIZE.
+ * @return number of bytes
+ */
+extern size_t mtxorb_handle_size(void);
+
 /**
  * Close a session.
  */
 extern void mtxorb_close(MTXORB *handle);
 
+/**
+ * Check whether the port is gone, e.g. an unplugged USB adapter. The hang-up
+ * is also noticed while reading, see mtxorb_read() and
+ * mtxorb_process_input(), and by failed writes.
+ * @return 1 if the port hung up, 0 if not
+ */
+extern int mtxorb_link_lost(MTXORB *handle);
+
+/**
+ * Reopen the port after it was lost, with the name, baud rate and options
+ * it was opened with. The cached state is kept.
+ * MTXORB_RESTART_WARM: the display kept its state, nothing is sent. If
+ *                      output was lost while the port was gone, the
+ *                      command it cut off is finished first, padded if
+ *                      its bytes were dropped, then the display is
+ *                      restored as on a cold restart.
+ * MTXORB_RESTART_COLD: the display was reset. It is cleared and gets the
+ *                      cached settings, custom characters and the
+ *                      framebuffer's non-blank cells again. Output queued
+ *                      before is dropped.
+ * Remove the display from its group first. On failure the handle stays
+ * without a port and can be reconnected again; async output stays off
+ * until a reconnect succeeds.
+ * @restart:    MTXORB_RESTART_WARM or MTXORB_RESTART_COLD
+ * @return 0 on success, or -1 if error
+ */
+extern int mtxorb_reconnect(MTXORB *handle, enum mtxorb_restart restart);
+
+/**
+ * Set buffered output on/off. When on, commands are queued in the handle
+ * and sent with a single write by mtxorb_flush(), mtxorb_close() or when
+ * the queue reaches the high-water mark. Turning it off flushes the queue.
+ * @on:         on: buffered, off: write every command directly (default)
+ * @high_water: number of queued bytes that triggers a flush, 0 = queue size
+ */
+extern void mtxorb_set_buffered(MTXORB *handle, enum mtxorb_onoff on, size_t high_water);
+
+/**
+ * Send all queued output to the display. Short writes are resumed and a
+ * command is never left half written. On a port opened non-blocking only
+ * what the port takes right away is written and the rest stays queued: wait
+ * for POLLOUT on mtxorb_get_fd() and call again. Only a full queue makes the
+ * other functions wait for the port.
+ * @return 0 on success, -1 with errno EAGAIN if output is left in the queue,
+ *         or -1 with the errno of a write that failed since the last call,
+ *         in that case output was lost
+ */
+extern int mtxorb_flush(MTXORB *handle);
+
+/**
+ * Get the number of bytes handed to the library but not written yet.
+ * @return number of bytes
+ */
+extern size_t mtxorb_pending(MTXORB *handle);
+
+/**
+ * Set asynchronous output on/off. When on, output is handed to a writer
+ * thread owned by the handle through a lock-free ring, so the calling thread
+ * does not wait for the serial port. The handle must then only be used from
+ * one thread. Turning it off waits until all output has been written.
+ * Displays in a group can't be made async.
+ * @on:     on: async, off: write from the calling thread (default)
+ * @return 0 on success, or -1 if error
+ */
+extern int mtxorb_set_async(MTXORB *handle, enum mtxorb_onoff on);
+
+/**
+ * Wait until the writer thread has written all pending output.
+ * @timeout:    number of milliseconds to wait, -1 = forever
+ * @return 0 on success, or -1 on timeout (errno ETIMEDOUT) or if a write
+ *         failed since the last call, see mtxorb_flush()
+ */
+extern int mtxorb_sync(MTXORB *handle, int timeout);
+
+/**
+ * Change the communication speed. Sends the module's change baud rate
+ * command, then reprograms the port once everything queued has been sent.
+ * Note: Most modules remember the new speed across power cycles.
+ * @baudrate:   1200, 2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600,
+ *              76800 or 115200
+ * @return 0 on success, or -1 if error
+ */
+extern int mtxorb_set_baudrate(MTXORB *handle, int baudrate);
+
+/**
+ * Forget the cached display state, e.g. after the display was power cycled.
+ * Settings are normally only sent when they change, after this call the
+ * next value of every setting is sent and the framebuffer is repainted.
+ */
+extern void mtxorb_invalidate_state(MTXORB *handle);
+
+/**
+ * Get the counters of the handle, e.g. to see whether the link is saturated:
+ * long write() durations, short writes and EAGAIN failures mean the port
+ * doesn't keep up. The counters start at zero when the handle is opened.
+ * @stats:  pointer to counters to fill in
+ */
+extern void mtxorb_get_stats(MTXORB *handle, struct mtxorb_stats *stats);
+
+/**
+ * Set all counters of the handle to zero. In async mode call mtxorb_sync()
+ * first, the writer thread may be updating them.
+ */
+extern void mtxorb_reset_stats(MTXORB *handle);
+
+/**
+ * Record all output of the handle to a file, e.g. to replay it later with
+ * tools/mtxorb-replay. Bytes are recorded as the functions produce them,
+ * before buffering, so settings collapsed in the output queue appear in
+ * the trace with each value. Replaces a trace that is already open.
+ *
+ * The file starts with "MTXORB", a version byte (1), a zero byte and the
+ * baud rate (4 bytes). Each record holds the time since the previous record
+ * in microseconds (4 bytes), the enum mtxorb_api value of the function (1
+ * byte), the length (2 bytes) and the bytes. Numbers are little-endian.
+ * @path:   name of the file to create
+ * @return 0 on success, or -1 if error
+ */
+extern int mtxorb_trace_open(MTXORB *handle, const char *path);
+
+/**
+ * Stop recording and close the trace file. Done by mtxorb_close() as well.
+ * @return 0 on success, or -1 if writing the file failed
+ */
+extern int mtxorb_trace_close(MTXORB *handle);
+
 /* ----- Text related functions ----- */
 
 /**
@@ -110,6 +421,17 @@ extern void mtxorb_puts(MTXORB *handle, const char *s);
  */
 extern void mtxorb_write(MTXORB *handle, const void *buf, size_t nbytes);
 
+struct iovec;
+
+/**
+ * Write raw data gathered from several buffers, e.g. a command header and
+ * its data, without copying them together first. Unbuffered, the segments
+ * go out with a single writev() call.
+ * @iov:    array of segments, see writev(2)
+ * @iovcnt: number of segments
+ */
+extern void mtxorb_writev(MTXORB *handle, const struct iovec *iov, int iovcnt);
+
 /**
  * Read data from the display.
  * @buf:        pointer to buffer
@@ -119,6 +441,28 @@ extern void mtxorb_write(MTXORB *handle, const void *buf, size_t nbytes);
  */
 extern ssize_t mtxorb_read(MTXORB *handle, void *buf, size_t nbytes, int timeout);
 
+/**
+ * Get the file descriptor of the port, e.g. to wait for key presses with
+ * poll() or epoll next to other descriptors. Only wait for input on it,
+ * the library does all reading and writing.
+ * @return file descriptor
+ */
+extern int mtxorb_get_fd(MTXORB *handle);
+
+/**
+ * Read all pending input without blocking and queue it as key events.
+ * Call it when the file descriptor is readable.
+ * @return number of events queued, or -1 if error
+ */
+extern int mtxorb_process_input(MTXORB *handle);
+
+/**
+ * Get the oldest queued key event.
+ * @ev:     pointer to event to fill in
+ * @return 1 if an event was returned, 0 if the queue is empty
+ */
+extern int mtxorb_next_key(MTXORB *handle, struct mtxorb_key_event *ev);
+
 /**
  * Move the cursor to the specified position.
  * @x: column position, 0-based
@@ -157,6 +501,20 @@ extern void mtxorb_set_auto_line_wrap(MTXORB *handle, enum mtxorb_onoff on);
  */
 extern void mtxorb_set_custom_char(MTXORB *handle, int id, const char *data);
 
+/**
+ * Make a glyph available as a custom character. The library keeps track of
+ * the display's custom character bank, a glyph that is already there is not
+ * uploaded again. When the bank is full the least recently used glyph is
+ * replaced, so keep using the returned character code on every frame. A
+ * glyph still shown by a cell of the framebuffer or of the screen is never
+ * replaced: with all 8 in use, nothing is loaded and 'glyphs_missed' of
+ * the stats counts it. Bars and big numbers wipe the bank.
+ * @data:  pointer to glyph data, one byte per pixel row
+ * @return character code (0-7) to put on the display, or -1 if error
+ *         (errno ENOSPC: every custom character is shown)
+ */
+extern int mtxorb_load_glyph(MTXORB *handle, const char *data);
+
 /**
  * Place a horizontal bar on the screen. This will replace all custom characters
  * currently present in memory.
@@ -216,12 +574,20 @@ extern void mtxorb_set_bg_color(MTXORB *handle, int r, int g, int b);
 /* ----- General Purpose Output related functions ----- */
 
 /**
- * Set general purpose output states.
+ * Set general purpose output states. Only outputs that change are sent.
  * Note: Check with your display the number of outputs.
  * @flags: e.g. MTXORB_GPO1 | MTXORB_GPO2
  */
 extern void mtxorb_set_output(MTXORB *handle, enum mtxorb_gpo_flags flags);
 
+/**
+ * Set the states of a subset of the general purpose outputs, leaving the
+ * others untouched. Only outputs that change are sent, in a single write.
+ * @mask:  outputs to set, e.g. MTXORB_GPO1 | MTXORB_GPO2
+ * @flags: new states of the outputs in mask
+ */
+extern void mtxorb_set_output_mask(MTXORB *handle, enum mtxorb_gpo_flags mask, enum mtxorb_gpo_flags flags);
+
 /* ----- Keypad related functions ----- */
 
 /**
@@ -247,6 +613,496 @@ extern void mtxorb_set_key_auto_repeat(MTXORB *handle, enum mtxorb_onoff on);
  */
 extern void mtxorb_set_key_debounce_time(MTXORB *handle, int value);
 
+/* ----- Query related functions ----- */
+
+/*
+ * The module answers queries on the same line it sends key presses on.
+ * While a query is out, key auto-transmit is held off; key bytes that were
+ * already on their way are queued as key events, see mtxorb_next_key().
+ * Every wait is bounded by the timeout. The rest of a reply that arrives
+ * up to a second after its query timed out is dropped, not taken for key
+ * presses.
+ */
+
+/**
+ * Send a query command and read its reply.
+ * @op:         command byte after 0xFE, e.g. '6' for the firmware version
+ * @reply:      buffer for the reply
+ * @n:          number of reply bytes expected
+ * @timeout:    max. number of milliseconds for the whole query
+ * @return n, or -1 if error (ETIMEDOUT: the reply didn't arrive in time)
+ */
+extern int mtxorb_query(MTXORB *handle, int op, unsigned char *reply, size_t n, int timeout);
+
+/**
+ * Read the module type and firmware version. A known model also sets the
+ * geometry and type of the handle, as if opened with its device info.
+ * @module:     pointer to result
+ * @timeout:    max. number of milliseconds for both queries together
+ * @return 0 if the model is known, or -1 if error (ENODEV: unknown type
+ *         code, 'module' holds what was read)
+ */
+extern int mtxorb_probe(MTXORB *handle, struct mtxorb_module *module, int timeout);
+
+/* ----- Framebuffer related functions ----- */
+
+/*
+ * The framebuffer is a per-handle copy of the screen. Draw into it with the
+ * mtxorb_fb_* functions and call mtxorb_fb_present() to send only the cells
+ * that differ from what is on the display. Text written with the direct
+ * functions (mtxorb_puts(), mtxorb_hbar(), ...) is not tracked, call
+ * mtxorb_fb_invalidate() if you mix the two.
+ */
+
+/**
+ * Fill the framebuffer with spaces.
+ */
+extern void mtxorb_fb_clear(MTXORB *handle);
+
+/**
+ * Put a single character in the framebuffer.
+ * @x: column position, 0-based
+ * @y: row position, 0-based
+ * @c: character to put
+ */
+extern void mtxorb_fb_putc(MTXORB *handle, int x, int y, char c);
+
+/**
+ * Put a string in the framebuffer, clipped at the end of the row.
+ * @x: column start position, 0-based
+ * @y: row position, 0-based
+ * @s: pointer to null-terminated string
+ */
+extern void mtxorb_fb_put(MTXORB *handle, int x, int y, const char *s);
+
+/**
+ * Draw a horizontal bar in the framebuffer. The bar is made of custom
+ * characters loaded with mtxorb_load_glyph(), so unlike mtxorb_hbar() it can
+ * be mixed with vertical bars and other custom characters on one screen.
+ * With every custom character shown elsewhere, cells filled at least
+ * halfway fall back to the full block of the character ROM, others to ' '.
+ * @x:     column start position, 0-based
+ * @y:     row position, 0-based
+ * @width: number of cells the bar occupies, counted from x in direction dir
+ * @len:   length of the bar in pixels, 0-(width * cellwidth)
+ * @dir:   direction of the bar
+ */
+extern void mtxorb_fb_hbar(MTXORB *handle, int x, int y, int width, int len, enum mtxorb_dir dir);
+
+/**
+ * Draw a vertical bar in the framebuffer, growing upwards. Uses custom
+ * characters, see mtxorb_fb_hbar().
+ * @x:      column position, 0-based
+ * @y:      row position of the bottom cell, 0-based
+ * @height: number of cells the bar occupies, counted upwards from y
+ * @len:    length of the bar in pixels, 0-(height * cellheight)
+ */
+extern void mtxorb_fb_vbar(MTXORB *handle, int x, int y, int height, int len);
+
+/**
+ * Draw a big digit in the framebuffer, 3 columns wide and 2 rows high.
+ * Unlike mtxorb_bignum() it leaves the module's character memory to the
+ * glyph cache: all big characters share 4 custom characters, which can be
+ * mixed with bars and other glyphs on one screen, and the full block of
+ * the character ROM. Glyphs shown elsewhere are never replaced, so with
+ * fewer than 4 custom characters free, the parts needing the missing ones
+ * stay blank and 'glyphs_missed' of the stats counts them.
+ * @x:      column position of the top left cell, 0-based
+ * @y:      row position of the top left cell, 0-based
+ * @digit:  0-9
+ */
+extern void mtxorb_fb_bignum(MTXORB *handle, int x, int y, int digit);
+
+/**
+ * Draw a string in big characters, see mtxorb_fb_bignum(). Digits and '-'
+ * are 3 columns wide, ':' and ' ' one column. Other characters are drawn
+ * as ' '. E.g. a "12:34:56" clock takes 20 columns.
+ * @x:  column start position, 0-based
+ * @y:  row position of the top row, 0-based
+ * @s:  pointer to null-terminated string
+ * @return number of columns drawn, clipped parts included
+ */
+extern int mtxorb_fb_bigstr(MTXORB *handle, int x, int y, const char *s);
+
+/**
+ * Put one of the built-in icons in the framebuffer, loaded as a custom
+ * character with mtxorb_load_glyph(). Blank if no custom character is free.
+ * @x:      column position, 0-based
+ * @y:      row position, 0-based
+ * @icon:   icon to put
+ */
+extern void mtxorb_fb_icon(MTXORB *handle, int x, int y, enum mtxorb_icon icon);
+
+/**
+ * Forget what is on the display, so the next present repaints everything.
+ */
+extern void mtxorb_fb_invalidate(MTXORB *handle);
+
+/**
+ * Send the changed cells of the framebuffer to the display. The cursor is
+ * moved to each changed run the cheapest way: rewriting a few unchanged
+ * cells, following the line wrap or an absolute goto. Flushes the output
+ * queue in buffered mode.
+ * @return number of bytes sent
+ */
+extern int mtxorb_fb_present(MTXORB *handle);
+
+/**
+ * Get the number of bytes the framebuffer's changes take to send, without
+ * sending anything. Widgets are only drawn by mtxorb_fb_present() and
+ * mtxorb_fb_tick(), their changes since the last frame are not counted.
+ * @return number of bytes
+ */
+extern int mtxorb_fb_cost(MTXORB *handle);
+
+/**
+ * Set the refresh rate used by mtxorb_fb_tick(). Each frame may send as many
+ * bytes as the port carries in one frame interval at its baud rate, also
+ * after mtxorb_set_baudrate(). Rates above 1000 give a frame per ms.
+ * @fps:    frames per second, 0 = no limit (default)
+ */
+extern void mtxorb_fb_set_rate(MTXORB *handle, int fps);
+
+/**
+ * Mark a region of the framebuffer as high-priority. When a frame doesn't
+ * fit in the byte budget, changed high-priority cells are sent first.
+ * @x:      column start position, 0-based
+ * @y:      row start position, 0-based
+ * @width:  number of columns
+ * @height: number of rows
+ * @on:     on: high-priority, off: normal (default)
+ */
+extern void mtxorb_fb_set_priority(MTXORB *handle, int x, int y, int width, int height, enum mtxorb_onoff on);
+
+/**
+ * Present the framebuffer if a frame is due, within the frame's byte budget.
+ * Call it as often as you like, all changes since the last frame are merged
+ * into one update. Cells that didn't fit are sent in the next frame.
+ * @return number of bytes sent, 0 if no frame was due or nothing changed
+ */
+extern int mtxorb_fb_tick(MTXORB *handle);
+
+/**
+ * Get the time until mtxorb_fb_tick() will send the next frame, e.g. as a
+ * poll() timeout. With nothing to send it is the time until the next step
+ * of a marquee.
+ * @return milliseconds until the next frame, 0 if due, -1 if nothing changed
+ */
+extern int mtxorb_fb_next_tick(MTXORB *handle);
+
+/* ----- Widget related functions ----- */
+
+/*
+ * Widgets are text regions of one row in the framebuffer: labels, scrolling
+ * marquees and numeric fields. They are drawn into the framebuffer by
+ * mtxorb_fb_present() and mtxorb_fb_tick(), only when their content changed
+ * or a marquee moved on, and the frame then carries only the cells that
+ * differ from the display. Up to 16 widgets per display. mtxorb_fb_clear()
+ * makes them draw themselves again.
+ */
+
+/**
+ * Add a label, a text that doesn't move. Text wider than the label is cut off.
+ * @x:      column start position, 0-based
+ * @y:      row position, 0-based
+ * @width:  number of columns
+ * @align:  position of text narrower than the label
+ * @return widget id, or -1 if error
+ */
+extern int mtxorb_widget_label(MTXORB *handle, int x, int y, int width, enum mtxorb_align align);
+
+/**
+ * Add a marquee. Text wider than the marquee scrolls to the left by one
+ * column per step, starting over after a gap of blanks. Text that fits
+ * stays left aligned. Use mtxorb_fb_tick() and mtxorb_fb_next_tick() to
+ * keep it moving.
+ * @step_ms:    milliseconds per step
+ * @return widget id, or -1 if error
+ */
+extern int mtxorb_widget_marquee(MTXORB *handle, int x, int y, int width, int step_ms);
+
+/**
+ * Add a numeric field, right aligned. A value wider than the field is shown
+ * as '#' characters rather than cut off.
+ * @decimals:   number of digits after the decimal point, 0-9
+ * @return widget id, or -1 if error
+ */
+extern int mtxorb_widget_number(MTXORB *handle, int x, int y, int width, int decimals);
+
+/**
+ * Set the text of a widget, up to 128 characters. Setting the same text
+ * again doesn't redraw anything, a new text restarts a marquee.
+ * @id: widget id
+ * @s:  pointer to null-terminated string
+ */
+extern void mtxorb_widget_set_text(MTXORB *handle, int id, const char *s);
+
+/**
+ * Set the value of a numeric field, e.g. 2315 is shown as "23.15" with 2
+ * decimals.
+ * @id:     widget id
+ * @value:  value in units of the last decimal
+ */
+extern void mtxorb_widget_set_value(MTXORB *handle, int id, long value);
+
+/**
+ * Remove a widget, blanking its cells.
+ * @id: widget id
+ */
+extern void mtxorb_widget_remove(MTXORB *handle, int id);
+
+/* ----- Batch related functions ----- */
+
+/*
+ * A handle belongs to one thread. Other threads that want to show something
+ * build a batch on their own, without touching the handle, and hand it over
+ * with mtxorb_batch_commit(). A batch goes out in one piece: commands of
+ * other threads never land between its gotoxy and its text.
+ */
+
+#define MTXORB_BATCH_SIZE 256
+
+struct mtxorb_batch {
+    size_t len;
+    int overflow;           /* set when a command didn't fit */
+    unsigned char buf[MTXORB_BATCH_SIZE];
+};
+
+/**
+ * Empty a batch.
+ */
+extern void mtxorb_batch_init(struct mtxorb_batch *b);
+
+/**
+ * Append a cursor move to a batch.
+ * @x:      column, starting from 0
+ * @y:      row, starting from 0
+ */
+extern void mtxorb_batch_gotoxy(struct mtxorb_batch *b, int x, int y);
+
+/**
+ * Append a character to a batch. 0xFE is sent as a space.
+ */
+extern void mtxorb_batch_putc(struct mtxorb_batch *b, int c);
+
+/**
+ * Append a string to a batch. 0xFE is sent as a space.
+ */
+extern void mtxorb_batch_puts(struct mtxorb_batch *b, const char *s);
+
+/**
+ * Append raw bytes to a batch.
+ */
+extern void mtxorb_batch_write(struct mtxorb_batch *b, const void *buf, size_t n);
+
+/**
+ * Send a batch as one unit and empty it. May be called from any thread if
+ * the handle was opened with the 'threadsafe' option, see
+ * mtxorb_open_ex(). The cursor position of the framebuffer is unknown
+ * afterwards.
+ * @return 0 on success, or -1 if error (ENOBUFS: the batch overflowed,
+ *         nothing was sent)
+ */
+extern int mtxorb_batch_commit(MTXORB *handle, struct mtxorb_batch *b);
+
+/**
+ * Hold the output of a handle opened with the 'threadsafe' option, so that
+ * the owner's calls up to mtxorb_unlock() go out without batches in between,
+ * e.g. mtxorb_gotoxy() followed by mtxorb_puts(). Calls nest.
+ */
+extern void mtxorb_lock(MTXORB *handle);
+
+/**
+ * Release the output held by mtxorb_lock().
+ */
+extern void mtxorb_unlock(MTXORB *handle);
+
+/* ----- Multi-display related functions ----- */
+
+/*
+ * A group drives up to 16 displays from one epoll loop. Each display keeps
+ * its own output queue and framebuffer, but writes never block: what the
+ * port doesn't take right away is sent by mtxorb_group_run() once the port
+ * is writable again. A slow link only delays its own display.
+ */
+
+#ifndef MTXORB_NO_MALLOC
+/**
+ * Create an empty group.
+ * @return valid group or NULL in case of error
+ */
+extern MTXORB_GROUP *mtxorb_group_new(void);
+
+/**
+ * Remove all displays from the group and free it. The displays stay open.
+ */
+extern void mtxorb_group_free(MTXORB_GROUP *group);
+#endif /* MTXORB_NO_MALLOC */
+
+/**
+ * Add a display to the group. Turns on buffered output and makes the port
+ * non-blocking. Async displays can't be added.
+ * @return 0 on success, or -1 if error
+ */
+extern int mtxorb_group_add(MTXORB_GROUP *group, MTXORB *handle);
+
+/**
+ * Remove a display from the group, sending its remaining output. The
+ * buffering and blocking mode it had before mtxorb_group_add() are restored.
+ * Do this before closing a display that is in a group.
+ */
+extern void mtxorb_group_remove(MTXORB_GROUP *group, MTXORB *handle);
+
+/**
+ * Get the file descriptor of the group, to wait on it in another poll, select
+ * or epoll loop. It is readable when mtxorb_group_run() has work to do.
+ * @return file descriptor
+ */
+extern int mtxorb_group_get_fd(MTXORB_GROUP *group);
+
+/**
+ * Present the framebuffer of every display in the group.
+ */
+extern void mtxorb_group_present(MTXORB_GROUP *group);
+
+/**
+ * Wait for the ports of the group and service them: write pending output
+ * and queue key events, see mtxorb_next_key(). The wait ends early when a
+ * paced display may write again, see 'pace_us'.
+ * @timeout:    number of milliseconds to wait, 0 = non-blocking, -1 = forever
+ * @return number of ports serviced, or -1 if error
+ */
+extern int mtxorb_group_run(MTXORB_GROUP *group, int timeout);
+
+/* ----- Fast path related functions ----- */
+
+/*
+ * For tight loops, e.g. bars driven by a sensor, commands can be encoded
+ * by inline functions straight into the output queue: reserve room, encode
+ * one or more commands into it and commit the bytes encoded. The encoders
+ * don't look at the state of the handle. Load the bar set by calling the
+ * library's bar function once, and expect the cursor position to be unknown
+ * after a commit.
+ */
+
+/**
+ * Reserve room for output, to be filled in and sent by mtxorb_commit().
+ * Don't call other functions of the handle in between.
+ * @n:      number of bytes, at most 512
+ * @return pointer to the room, or NULL if n is too large
+ */
+extern unsigned char *mtxorb_reserve(MTXORB *handle, size_t n);
+
+/**
+ * Send the output encoded into the room from mtxorb_reserve(). It is queued
+ * in buffered mode, otherwise written right away.
+ * @n:      number of bytes encoded, at most the number reserved
+ */
+extern void mtxorb_commit(MTXORB *handle, size_t n);
+
+/* The encoders are only defined when MTXORB_FAST is defined before including
+ * this file. Each one writes a command to 'out' and returns its length, or 0
+ * if an argument is out of range. The display type and geometry are plain
+ * arguments: passed as constants, the checks are resolved by the compiler. */
+#ifdef MTXORB_FAST
+
+#if defined(__cplusplus) || (defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L))
+#define MTXORB_INLINE static inline
+#elif defined(__GNUC__)
+#define MTXORB_INLINE static __inline__
+#else
+#define MTXORB_INLINE static
+#endif
+
+MTXORB_INLINE size_t mtxorb_enc_gotoxy(unsigned char *out, int width, int height, int x, int y)
+{
+    if ((x < 0) || (x >= width) || (y < 0) || (y >= height))
+        return 0;
+
+    out[0] = 0xFE;
+    out[1] = 'G';
+    out[2] = (unsigned char)(x + 1);
+    out[3] = (unsigned char)(y + 1);
+
+    return 4;
+}
+
+MTXORB_INLINE size_t mtxorb_enc_hbar(unsigned char *out, int width, int height,
+                                     int x, int y, int len, enum mtxorb_dir dir)
+{
+    if ((x < 0) || (x >= width) || (y < 0) || (y >= height) ||
+        (len < 0) || (len > 100))
+        return 0;
+
+    out[0] = 0xFE;
+    out[1] = 0x7C;
+    out[2] = (unsigned char)(x + 1);
+    out[3] = (unsigned char)(y + 1);
+    out[4] = (dir == MTXORB_LEFT) ? 1 : 0;
+    out[5] = (unsigned char)len;
+
+    return 6;
+}
+
+MTXORB_INLINE size_t mtxorb_enc_vbar(unsigned char *out, int width, int x, int len)
+{
+    if ((x < 0) || (x >= width) || (len < 0) || (len > 32))
+        return 0;
+
+    out[0] = 0xFE;
+    out[1] = '=';
+    out[2] = (unsigned char)(x + 1);
+    out[3] = (unsigned char)len;
+
+    return 4;
+}
+
+/* Set one output, 0-based. LCD and VFD displays only have output 0. */
+MTXORB_INLINE size_t mtxorb_enc_output(unsigned char *out, enum mtxorb_type type, int gpo, enum mtxorb_onoff on)
+{
+    out[0] = 0xFE;
+    out[1] = (on == MTXORB_ON) ? 'W' : 'V';
+
+    if ((type == MTXORB_LKD) || (type == MTXORB_VKD))
+    {
+        if ((gpo < 0) || (gpo >= 6))
+            return 0;
+        out[2] = (unsigned char)(gpo + 1);
+        return 3;
+    }
+
+    return (gpo == 0) ? 2 : 0;
+}
+
+/*
+ * Define inline functions for a display known at compile time, each
+ * sending one command:
+ *   <name>_gotoxy(handle, x, y)
+ *   <name>_hbar(handle, x, y, len, dir)
+ *   <name>_vbar(handle, x, len)
+ *   <name>_output(handle, gpo, on)
+ * E.g. MTXORB_DEFINE_FAST(panel, MTXORB_LKD, 20, 4) defines panel_hbar().
+ */
+#define MTXORB_DEFINE_FAST(name, type, width, height) \
+    MTXORB_INLINE void name##_gotoxy(MTXORB *handle, int x, int y) \
+    { \
+        mtxorb_commit(handle, mtxorb_enc_gotoxy(mtxorb_reserve(handle, 4), width, height, x, y)); \
+    } \
+    MTXORB_INLINE void name##_hbar(MTXORB *handle, int x, int y, int len, enum mtxorb_dir dir) \
+    { \
+        mtxorb_commit(handle, mtxorb_enc_hbar(mtxorb_reserve(handle, 6), width, height, x, y, len, dir)); \
+    } \
+    MTXORB_INLINE void name##_vbar(MTXORB *handle, int x, int len) \
+    { \
+        mtxorb_commit(handle, mtxorb_enc_vbar(mtxorb_reserve(handle, 4), width, x, len)); \
+    } \
+    MTXORB_INLINE void name##_output(MTXORB *handle, int gpo, enum mtxorb_onoff on) \
+    { \
+        mtxorb_commit(handle, mtxorb_enc_output(mtxorb_reserve(handle, 3), type, gpo, on)); \
+    }
+
+#endif /* MTXORB_FAST */
+
 #ifdef __cplusplus
 }
 #endif
@@ -25,7 +25,8 @@ static void handle_signal(int sig);
 int main(void)
 {
     MTXORB *mtxorb;
-    char key;
+    struct mtxorb_key_event ev;
+    struct pollfd fds[1];
 
     const char some_buffer[] = { 0x43, 0x6f, 0x66, 0x66, 0x65, 0x65 };
     const char custom_char[] = { 0x00, 0x0A, 0x1F, 0x1F, 0x0E, 0x04, 0x00, 0x00 };
@@ -82,10 +83,19 @@ int main(void)
 
 /*******************************************************************/
 
+    /* The port can be waited on together with other descriptors */
+    fds[0].fd = mtxorb_get_fd(mtxorb);
+    fds[0].events = POLLIN;
+
     while (is_running) {
-        /* Check for avail. input data with a timeout of 100ms */
-        if (mtxorb_read(mtxorb, &key, 1, 100) > 0)
-            printf("mtxorb: key pressed '%c' (0x%02X)\n", key, key);
+        /* Sleep until input arrives or a signal interrupts us */
+        if (poll(fds, 1, -1) <= 0)
+            continue;
+
+        mtxorb_process_input(mtxorb);
+        while (mtxorb_next_key(mtxorb, &ev))
+            printf("mtxorb: key pressed '%c' (0x%02X) at %ld.%06ld\n",
+                   ev.key, ev.key, ev.sec, ev.usec);
     }
 
     mtxorb_backlight_off(mtxorb);
@@ -0,0 +1,348 @@
+/* The POSIX clocks are hidden when compiling with -std=c89 */
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "mtxorb.h"
+
+#define RECORD_MAX 0xFFFF
+
+
+/* Indexed by enum mtxorb_api */
+static const char *api_names[] = {
+    "none", "clear", "putc", "puts", "write", "gotoxy",
+    "set_cursor_block", "set_cursor_uline", "set_auto_scroll", "set_auto_line_wrap",
+    "set_custom_char", "hbar", "vbar", "bignum", "backlight_off",
+    "set_contrast", "set_brightness", "set_bg_color", "set_output",
+    "keypad_backlight_off", "set_keypad_brightness", "set_key_auto_repeat",
+    "set_key_debounce_time", "fb_present", "fb_tick", "set_baudrate", "writev", "commit", "batch", "query"
+};
+
+#define API_COUNT ((int)(sizeof(api_names) / sizeof(api_names[0])))
+
+struct record {
+    unsigned long delta;    /* us since the previous record */
+    int api;
+    size_t len;
+    unsigned char data[RECORD_MAX];
+};
+
+static unsigned long get_le(const unsigned char *b, int n);
+static int read_header(FILE *f, int *baudrate);
+static int read_record(FILE *f, struct record *r);
+static const char *api_name(int api);
+static void print_record(const struct record *r, double t);
+static int summarize(FILE *f, int baudrate, int verbose);
+static int replay(FILE *f, const char *port, int baudrate, double speed, int verbose);
+static int open_port(const char *port, int baudrate);
+static int write_all(int fd, const unsigned char *buf, size_t n);
+static speed_t baud_to_speed(int baudrate);
+static void usage(const char *name);
+
+static struct record rec;
+
+
+int main(int argc, char *argv[])
+{
+    FILE *f;
+    double speed = 1.0;
+    int baudrate = 0, trace_baudrate;
+    int verbose = 0;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "b:s:v")) != -1) {
+        switch (opt) {
+        case 'b':
+            baudrate = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((optind >= argc) || (argc - optind > 2) || (speed < 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((f = fopen(argv[optind], "rb")) == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (read_header(f, &trace_baudrate) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+
+    if (baudrate <= 0)
+        baudrate = trace_baudrate;
+
+    if (optind + 1 < argc)
+        ret = replay(f, argv[optind + 1], baudrate, speed, verbose);
+    else
+        ret = summarize(f, baudrate, verbose);
+
+    fclose(f);
+
+    return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-b baudrate] [-s speed] [-v] trace [port]\n"
+            "Replays a trace recorded with mtxorb_trace_open() into a port, e.g. a pty\n"
+            "or a display, sending nothing but the recorded bytes. Without a port,\n"
+            "prints the bytes each function produced. These are counted before the\n"
+            "output queue: settings overwritten in the queue count with each value.\n"
+            "  -b  baud rate, default: the rate the trace was recorded at\n"
+            "  -s  playback speed, 2 = twice as fast, 0 = no delays (default: 1)\n"
+            "  -v  print every record\n", name);
+}
+
+/* Print the number of records and bytes per function and how busy the
+ * link was at the given baud rate. The trace holds the bytes as functions
+ * produced them, so with buffered output the wire may have carried less. */
+static int summarize(FILE *f, int baudrate, int verbose)
+{
+    unsigned long records[API_COUNT + 1];
+    unsigned long bytes[API_COUNT + 1];
+    unsigned long total = 0;
+    double t = 0, wire;
+    int i, r;
+
+    memset(records, 0, sizeof(records));
+    memset(bytes, 0, sizeof(bytes));
+
+    while ((r = read_record(f, &rec)) == 1) {
+        t += rec.delta / 1e6;
+        if (verbose)
+            print_record(&rec, t);
+
+        /* Unknown ids, from a newer library, are counted together */
+        i = (rec.api < API_COUNT) ? rec.api : API_COUNT;
+        records[i]++;
+        bytes[i] += rec.len;
+        total += rec.len;
+    }
+
+    printf("%-24s %10s %10s %7s\n", "function", "records", "bytes", "share");
+    for (i = 0; i <= API_COUNT; i++) {
+        if (records[i] > 0)
+            printf("%-24s %10lu %10lu %6.1f%%\n", api_name(i), records[i], bytes[i],
+                   (total > 0) ? 100.0 * bytes[i] / total : 0.0);
+    }
+
+    /* 8-N-1 takes 10 bits per byte on the wire */
+    wire = total * 10.0 / baudrate;
+    printf("\n%lu bytes produced in %.3f s, %.3f s on the wire at %d baud (%.1f%% busy)\n",
+           total, t, wire, baudrate, (t > 0) ? 100.0 * wire / t : 100.0);
+
+    if (r < 0) {
+        fprintf(stderr, "trace is truncated\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Send the records to the port, keeping the recorded gaps divided by speed */
+static int replay(FILE *f, const char *port, int baudrate, double speed, int verbose)
+{
+    struct timespec start, due;
+    double t = 0, at;
+    int fd, r;
+
+    /* Not mtxorb_open(), which would clear the display first */
+    if ((fd = open_port(port, baudrate)) == -1) {
+        perror(port);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ((r = read_record(f, &rec)) == 1) {
+        t += rec.delta / 1e6;
+
+        if (speed > 0) {
+            at = start.tv_sec + start.tv_nsec / 1e9 + t / speed;
+            due.tv_sec = (time_t)at;
+            due.tv_nsec = (long)((at - due.tv_sec) * 1e9);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+        }
+
+        if (verbose)
+            print_record(&rec, t);
+
+        if (write_all(fd, rec.data, rec.len) == -1) {
+            perror(port);
+            close(fd);
+            return -1;
+        }
+    }
+
+    tcdrain(fd);
+    close(fd);
+
+    if (r < 0) {
+        fprintf(stderr, "trace is truncated\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Open the port raw, 8-N-1 without flow control like mtxorb_open() */
+static int open_port(const char *port, int baudrate)
+{
+    struct termios tio;
+    speed_t speed = baud_to_speed(baudrate);
+    int fd;
+
+    if (speed == B0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((fd = open(port, O_RDWR | O_NOCTTY)) == -1)
+        return -1;
+
+    /* A pty or another non-serial port keeps its settings */
+    if (tcgetattr(fd, &tio) == 0) {
+        memset(&tio, 0, sizeof(tio));
+        tio.c_cflag = CS8 | CLOCAL | CREAD;
+        tio.c_iflag = IGNPAR;
+        tio.c_cc[VMIN] = 1;
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+        tcflush(fd, TCIOFLUSH);
+        if (tcsetattr(fd, TCSANOW, &tio) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t n)
+{
+    ssize_t r;
+
+    while (n > 0) {
+        r = write(fd, buf, n);
+        if ((r == -1) && (errno == EINTR))
+            continue;
+        if (r == -1)
+            return -1;
+        buf += r;
+        n -= r;
+    }
+
+    return 0;
+}
+
+static speed_t baud_to_speed(int baudrate)
+{
+    switch (baudrate) {
+    case 1200:
+        return B1200;
+    case 2400:
+        return B2400;
+    case 4800:
+        return B4800;
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+#ifdef B230400
+    case 230400:
+        return B230400;
+#endif
+    default:
+        return B0;
+    }
+}
+
+static void print_record(const struct record *r, double t)
+{
+    size_t i;
+
+    printf("%10.6f %-22s %5lu ", t, api_name(r->api), (unsigned long)r->len);
+    for (i = 0; i < r->len; i++) {
+        if ((r->data[i] >= 0x20) && (r->data[i] < 0x7F))
+            printf(" %c", r->data[i]);
+        else
+            printf(" %02X", r->data[i]);
+    }
+    printf("\n");
+}
+
+static const char *api_name(int api)
+{
+    return (api < API_COUNT) ? api_names[api] : "unknown";
+}
+
+static unsigned long get_le(const unsigned char *b, int n)
+{
+    unsigned long v = 0;
+
+    while (n-- > 0)
+        v = (v << 8) | b[n];
+
+    return v;
+}
+
+static int read_header(FILE *f, int *baudrate)
+{
+    unsigned char hdr[12];
+
+    if ((fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) ||
+        (memcmp(hdr, "MTXORB", 6) != 0) || (hdr[6] != 1))
+        return -1;
+
+    *baudrate = (int)get_le(hdr + 8, 4);
+
+    return 0;
+}
+
+/* Returns 1 if a record was read, 0 at the end of the file, -1 if truncated */
+static int read_record(FILE *f, struct record *r)
+{
+    unsigned char hdr[7];
+    size_t n;
+
+    if ((n = fread(hdr, 1, sizeof(hdr), f)) != sizeof(hdr))
+        return (n == 0) ? 0 : -1;
+
+    r->delta = get_le(hdr, 4);
+    r->api = hdr[4];
+    r->len = get_le(hdr + 5, 2);
+
+    if (fread(r->data, 1, r->len, f) != r->len)
+        return -1;
+
+    return 1;
+}